@@ -36,6 +36,8 @@
 #include <linux/pci.h>
 #include <linux/netdevice.h>
 #include <linux/vmalloc.h>
+#include <linux/hashtable.h>
+#include <linux/scatterlist.h>
 
 #ifdef SIOCETHTOOL
 #include <linux/ethtool.h>
@@ -46,10 +48,21 @@ struct igb_adapter;
 struct igb_user_page;
 
 struct igb_user_page {
-	struct igb_user_page *prev;
-	struct igb_user_page *next;
+	struct hlist_node node;		/* igb_private_data.userpages */
 	struct page *page;
 	dma_addr_t page_dma;
+	unsigned int order;	/* PAGE_SIZE << order bytes */
+};
+
+/* application memory pinned and mapped by IGB_IOCTL_PIN */
+struct igb_user_pin {
+	struct list_head list;		/* igb_private_data.userpins */
+	u64 handle;
+	struct page **pages;
+	unsigned int npages;
+	struct sg_table sgt;
+	enum dma_data_direction dir;
+	struct mm_struct *mm;		/* charged for npages locked pages */
 };
 #if defined(CONFIG_DCA) || defined(CONFIG_DCA_MODULE)
 #define IGB_DCA
@@ -583,6 +596,9 @@ struct igb_adapter {
 	/* user-dma specific variables */
 	u32	uring_tx_init;
 	u32	uring_rx_init;
+	/* user queue interrupts seen since armed, IGB_UEVENT_* bits */
+	unsigned long	uring_events;
+	wait_queue_head_t	uring_wait;
 #ifndef HAVE_NETDEV_STATS_IN_NETDEV
 	struct net_device_stats net_stats;
 #endif
@@ -895,6 +911,13 @@ void igb_procfs_topdir_exit(void);
 #define IGB_IOCTL_UNMAPBUF      _IOW('E', 305, int)
 #define IGB_IOCTL_MAP_RX_RING   _IOW('E', 307, int)
 #define IGB_IOCTL_UNMAP_RX_RING _IOW('E', 308, int)
+#define IGB_IOCTL_ARM		_IOW('E', 309, int)
+#define IGB_IOCTL_MAPREGION	_IOW('E', 310, int)
+#define IGB_IOCTL_MAPBUF_BATCH	_IOW('E', 311, int)
+#define IGB_IOCTL_UNMAPBUF_BATCH _IOW('E', 312, int)
+#define IGB_IOCTL_NUMA_NODE	_IOW('E', 313, int)
+#define IGB_IOCTL_PIN		_IOW('E', 314, int)
+#define IGB_IOCTL_UNPIN		_IOW('E', 315, int)
 
 
 /*END*/
@@ -919,19 +942,99 @@ struct igb_buf_cmd {
 	u64	 	pa;
 };
 
+/*
+ * physically contiguous buffer region, freed with IGB_IOCTL_UNMAPBUF;
+ * size is the requested size in and the mapped size out
+ */
+#define IGB_REGION_MAX	(2 * 1024 * 1024)
+#define IGB_REGION_HUGE	1	/* a whole, 2 MB aligned IGB_REGION_MAX */
+
+struct igb_region_cmd {
+	u64		physaddr;
+	u64		pa;
+	u32		size;
+	u32		flags;
+};
+
+/*
+ * map or unmap count single-page buffers in one call; bufs points to an
+ * array of struct igb_buf_cmd, done returns how many were processed
+ */
+#define IGB_BUF_BATCH_MAX	256
+
+struct igb_buf_batch_cmd {
+	u64		bufs;
+	u32		count;
+	u32		done;
+};
+
+/*
+ * NUMA node for the buffers this file maps from now on: node is the
+ * node wanted in, or IGB_NODE_DEVICE for the NIC's own (the default);
+ * dev_node returns the NIC's node, -1 if unknown
+ */
+#define IGB_NODE_DEVICE	(-1)
+
+struct igb_node_cmd {
+	s32		node;
+	s32		dev_node;
+};
+
+/*
+ * pin and DMA-map the user range [addr, addr + len): bufs gets the bus
+ * address of each of its pages, starting with the page holding addr,
+ * and npages is the room there in and the pages pinned out (or needed,
+ * with -ENOSPC). IGB_IOCTL_UNPIN releases the range by handle.
+ */
+#define IGB_PIN_MAX_PAGES	4096
+#define IGB_PIN_WRITE		1	/* the NIC may write it (receive) */
+
+struct igb_pin_cmd {
+	u64		addr;
+	u64		len;
+	u64		bufs;
+	u64		handle;
+	u32		npages;
+	u32		flags;
+};
+
+/* poll() wake-ups for a user queue, flags 0 disarms */
+#define IGB_ARM_RX	1
+#define IGB_ARM_TX	2
+
+struct igb_arm_cmd {
+	u32		queue;
+	u32		flags;
+};
+
+/* bit numbers in uring_events and uring_armed */
+#define IGB_UEVENT_RX(q)	(q)
+#define IGB_UEVENT_TX(q)	(16 + (q))
+#define IGB_UEVENT_RX_MASK	0x0000ffffUL
+#define IGB_UEVENT_TX_MASK	0xffff0000UL
+
 struct igb_link_cmd {
 	u32		up;
 	u32		speed;
 	u32		duplex;
 };
 
+#define IGB_USERPAGE_HASH_BITS	10
+
 struct igb_private_data {
 	struct igb_adapter *adapter;
-	/* user-dma specific variable for buffer */
-	struct igb_user_page *userpages;
+	/* user-dma specific variable for buffer, hashed by page_dma */
+	DECLARE_HASHTABLE(userpages, IGB_USERPAGE_HASH_BITS);
+	/* pinned application memory, IGB_IOCTL_PIN */
+	struct list_head userpins;
+	u64	pin_seq;
 	/* user-dma specific variable for TX and RX */
 	u32	uring_tx_init;
 	u32	uring_rx_init;
+	/* queues poll() waits on, IGB_UEVENT_* bits */
+	u32	uring_armed;
+	/* node user buffers come from, NUMA_NO_NODE for the NIC's */
+	int	numa_node;
 };
 
 #endif /* _IGB_H_ */
@@ -66,6 +66,7 @@
 #endif /* CONFIG_PM_RUNTIME */
 
 #include <linux/if_bridge.h>
+#include <linux/poll.h>
 #include "igb.h"
 #include "igb_vmdq.h"
 
@@ -165,6 +166,7 @@ static void igb_setup_dca(struct igb_adapter *);
 static int igb_poll(struct napi_struct *, int);
 static bool igb_clean_tx_irq(struct igb_q_vector *);
 static bool igb_clean_rx_irq(struct igb_q_vector *, int);
+static void igb_uring_notify(struct igb_q_vector *);
 static int igb_ioctl(struct net_device *, struct ifreq *, int cmd);
 #if ( LINUX_VERSION_CODE < KERNEL_VERSION(5,6,0) )
 static void igb_tx_timeout(struct net_device *);
@@ -333,6 +335,9 @@ static struct miscdevice igb_miscdev = {
 		.fops = &igb_fops,
 };
 
+/* igb_user_page bookkeeping for buffers mapped to user space */
+static struct kmem_cache *igb_user_page_cache;
+
 static struct pci_driver igb_driver = {
 	.name     = igb_driver_name,
 	.id_table = igb_pci_tbl,
@@ -419,16 +424,41 @@ static int __init igb_init_module(void)
 #endif /* IGB_PROCFS */
 #endif /* IGB_HWMON  */
 
+	igb_user_page_cache = kmem_cache_create("igb_avb_userpage",
+						sizeof(struct igb_user_page),
+						0, 0, NULL);
+	if (!igb_user_page_cache) {
+		ret = -ENOMEM;
+		goto err_cache;
+	}
+
 #ifdef IGB_DCA
 	dca_register_notify(&dca_notifier);
 #endif
 	misc_register(&igb_miscdev);
 	ret = pci_register_driver(&igb_driver);
+	if (ret < 0)
+		goto err_register;
 #ifdef USE_REBOOT_NOTIFIER
-	if (ret >= 0)
-		register_reboot_notifier(&igb_notifier_reboot);
+	register_reboot_notifier(&igb_notifier_reboot);
 #endif
 	return ret;
+
+err_register:
+	misc_deregister(&igb_miscdev);
+#ifdef IGB_DCA
+	dca_unregister_notify(&dca_notifier);
+#endif
+	kmem_cache_destroy(igb_user_page_cache);
+err_cache:
+#ifdef IGB_HWMON
+/* only compile IGB_PROCFS if IGB_HWMON is not defined */
+#else
+#ifdef IGB_PROCFS
+	igb_procfs_topdir_exit();
+#endif /* IGB_PROCFS */
+#endif /* IGB_HWMON */
+	return ret;
 }
 
 module_init(igb_init_module);
@@ -449,6 +479,7 @@ static void __exit igb_exit_module(void)
 #endif
 	misc_deregister(&igb_miscdev);
 	pci_unregister_driver(&igb_driver);
+	kmem_cache_destroy(igb_user_page_cache);
 
 #ifdef IGB_HWMON
 /* only compile IGB_PROCFS if IGB_HWMON is not defined */
@@ -2774,6 +2805,8 @@ static int igb_probe(struct pci_dev *pdev,
 	adapter->uring_tx_init = 0;
 	adapter->uring_rx_init = 0;
 	mutex_init(&adapter->lock);
+	adapter->uring_events = 0;
+	init_waitqueue_head(&adapter->uring_wait);
 #ifdef HAVE_PCI_ERS
 	err = pci_save_state(pdev);
 	if (err)
@@ -3583,7 +3616,7 @@ int igb_setup_tx_resources(struct igb_ring *tx_ring)
 	int size;
 
 	size = sizeof(struct igb_tx_buffer) * tx_ring->count;
-	tx_ring->tx_buffer_info = vzalloc(size);
+	tx_ring->tx_buffer_info = vzalloc_node(size, dev_to_node(dev));
 	if (!tx_ring->tx_buffer_info)
 		goto err;
 
@@ -3746,7 +3779,7 @@ int igb_setup_rx_resources(struct igb_ring *rx_ring)
 	int size, desc_len;
 
 	size = sizeof(struct igb_rx_buffer) * rx_ring->count;
-	rx_ring->rx_buffer_info = vzalloc(size);
+	rx_ring->rx_buffer_info = vzalloc_node(size, dev_to_node(dev));
 	if (!rx_ring->rx_buffer_info)
 		goto err;
 
@@ -7364,6 +7397,8 @@ static int igb_poll(struct napi_struct *napi, int budget)
 	if (q_vector->adapter->flags & IGB_FLAG_DCA_ENABLED)
 		igb_update_dca(q_vector);
 #endif
+	igb_uring_notify(q_vector);
+
 	if (q_vector->tx.ring)
 		clean_complete = igb_clean_tx_irq(q_vector);
 
@@ -7387,6 +7422,35 @@ static int igb_poll(struct napi_struct *napi, int budget)
 	return 0;
 }
 
+/**
+ * igb_uring_notify - Wake poll() on the user (AVB) queues of a vector
+ * @q_vector: pointer to q_vector which just interrupted
+ *
+ * The kernel does not service the user queues, their interrupts only
+ * record an event and wake up whoever sleeps in igb_pollfd().
+ **/
+static void igb_uring_notify(struct igb_q_vector *q_vector)
+{
+	struct igb_adapter *adapter = q_vector->adapter;
+	struct igb_ring *ring;
+	bool wake = false;
+
+	ring = q_vector->rx.ring;
+	if (ring && (adapter->uring_rx_init & (1 << ring->queue_index))) {
+		set_bit(IGB_UEVENT_RX(ring->queue_index), &adapter->uring_events);
+		wake = true;
+	}
+
+	ring = q_vector->tx.ring;
+	if (ring && (adapter->uring_tx_init & (1 << ring->queue_index))) {
+		set_bit(IGB_UEVENT_TX(ring->queue_index), &adapter->uring_events);
+		wake = true;
+	}
+
+	if (wake)
+		wake_up_interruptible(&adapter->uring_wait);
+}
+
 /**
  * igb_clean_tx_irq - Reclaim resources after transmit completes
  * @q_vector: pointer to q_vector containing needed info
@@ -10330,9 +10394,33 @@ static int igb_init_avb(struct e1000_hw *hw)
 
 /* user-mode API routines */
 
+/*
+ * Readable when an armed receive queue, writable when an armed transmit
+ * queue of this file has interrupted since it was armed, see igb_arm().
+ */
 static unsigned int igb_pollfd(struct file *file, poll_table *wait)
 {
-	return -EINVAL; /* don't support reads for any status or data */
+	struct igb_private_data *igb_priv = file->private_data;
+	struct igb_adapter *adapter;
+	unsigned long events;
+	unsigned int mask = 0;
+
+	if (igb_priv == NULL)
+		return POLLERR;
+
+	adapter = igb_priv->adapter;
+	if (adapter == NULL)
+		return POLLERR;
+
+	poll_wait(file, &adapter->uring_wait, wait);
+
+	events = adapter->uring_events & igb_priv->uring_armed;
+	if (events & IGB_UEVENT_RX_MASK)
+		mask |= POLLIN | POLLRDNORM;
+	if (events & IGB_UEVENT_TX_MASK)
+		mask |= POLLOUT | POLLWRNORM;
+
+	return mask;
 }
 
 static ssize_t igb_read(struct file *file, char __user *buf, size_t count,
@@ -10484,6 +10572,138 @@ static long igb_getspeed(struct file *file, void __user *arg)
 	return 0;
 }
 
+/*
+ * Arm (or with flags 0, disarm) poll() wake-ups for a user queue mapped
+ * through this file. Arming forgets the interrupts seen so far, so the
+ * caller checks its ring once armed and only then sleeps in poll().
+ */
+static long igb_arm(struct file *file, void __user *arg)
+{
+	struct igb_private_data *igb_priv = file->private_data;
+	struct igb_adapter *adapter;
+	struct igb_arm_cmd req;
+	u32 rx, tx;
+
+	if (igb_priv == NULL) {
+		printk("cannot find private data!\n");
+		return -ENOENT;
+	}
+
+	adapter = igb_priv->adapter;
+	if (adapter == NULL) {
+		printk("arm on unbound device!\n");
+		return -ENOENT;
+	}
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	if (req.queue >= 3 || (req.flags & ~(IGB_ARM_RX | IGB_ARM_TX)))
+		return -EINVAL;
+
+	rx = 1 << IGB_UEVENT_RX(req.queue);
+	tx = 1 << IGB_UEVENT_TX(req.queue);
+
+	mutex_lock(&adapter->lock);
+	if (((req.flags & IGB_ARM_RX) &&
+	     !(igb_priv->uring_rx_init & (1 << req.queue))) ||
+	    ((req.flags & IGB_ARM_TX) &&
+	     !(igb_priv->uring_tx_init & (1 << req.queue)))) {
+		mutex_unlock(&adapter->lock);
+		return -EINVAL;
+	}
+
+	if (req.flags & IGB_ARM_RX) {
+		clear_bit(IGB_UEVENT_RX(req.queue), &adapter->uring_events);
+		igb_priv->uring_armed |= rx;
+	} else {
+		igb_priv->uring_armed &= ~rx;
+	}
+
+	if (req.flags & IGB_ARM_TX) {
+		clear_bit(IGB_UEVENT_TX(req.queue), &adapter->uring_events);
+		igb_priv->uring_armed |= tx;
+	} else {
+		igb_priv->uring_armed &= ~tx;
+	}
+	mutex_unlock(&adapter->lock);
+
+	return 0;
+}
+
+/*
+ * allocate and map PAGE_SIZE << order bytes of DMA memory for user space,
+ * on the file's NUMA node or else the NIC's
+ */
+static struct igb_user_page *igb_user_page_alloc(
+				struct igb_private_data *igb_priv,
+				unsigned int order)
+{
+	struct igb_adapter *adapter = igb_priv->adapter;
+	struct igb_user_page *userpage;
+	gfp_t gfp = GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN;
+	int node = igb_priv->numa_node;
+
+	userpage = kmem_cache_zalloc(igb_user_page_cache, GFP_KERNEL);
+	if (unlikely(!userpage))
+		return NULL;
+
+#if defined(CONFIG_IGB_SUPPORT_32BIT_IOCTL)
+#if defined(CONFIG_ZONE_DMA32)
+	gfp |= GFP_DMA32;
+#else /* defined(CONFIG_ZONE_DMA32) */
+	gfp |= GFP_DMA;
+#endif /* defined(CONFIG_ZONE_DMA32) */
+#endif /* defined(CONFIG_IGB_SUPPORT_32BIT_IOCTL) */
+
+	if (node == NUMA_NO_NODE)
+		node = dev_to_node(pci_dev_to_dev(adapter->pdev));
+
+	/* not __GFP_THISNODE: a remote page beats no page */
+	userpage->page = alloc_pages_node(node, gfp, order);
+	if (unlikely(!userpage->page))
+		goto page_failed;
+
+	userpage->order = order;
+	userpage->page_dma = dma_map_page(pci_dev_to_dev(adapter->pdev),
+					  userpage->page, 0, PAGE_SIZE << order,
+					  DMA_BIDIRECTIONAL);
+	if (dma_mapping_error(pci_dev_to_dev(adapter->pdev),
+			      userpage->page_dma))
+		goto map_failed;
+
+	return userpage;
+
+map_failed:
+	__free_pages(userpage->page, order);
+page_failed:
+	kmem_cache_free(igb_user_page_cache, userpage);
+	return NULL;
+}
+
+static void igb_user_page_free(struct igb_adapter *adapter,
+			       struct igb_user_page *userpage)
+{
+	dma_unmap_page(pci_dev_to_dev(adapter->pdev), userpage->page_dma,
+		       PAGE_SIZE << userpage->order, DMA_BIDIRECTIONAL);
+	__free_pages(userpage->page, userpage->order);
+	kmem_cache_free(igb_user_page_cache, userpage);
+}
+
+/* look up a mapped user page by DMA address, adapter->lock held */
+static struct igb_user_page *igb_user_page_find(
+				struct igb_private_data *igb_priv,
+				dma_addr_t physaddr)
+{
+	struct igb_user_page *userpage;
+
+	hash_for_each_possible(igb_priv->userpages, userpage, node, physaddr) {
+		if (userpage->page_dma == physaddr)
+			return userpage;
+	}
+	return NULL;
+}
+
 static long igb_mapbuf_user(struct file *file, void __user *arg, int ring)
 {
 	struct igb_private_data *igb_priv = file->private_data;
@@ -10493,9 +10713,6 @@ static long igb_mapbuf_user(struct file *file, void __user *arg, int ring)
  	  between userspace and kernel space	
 	  introduced to handle possible mismatch in libigb and igb version*/
 	int buf_cmd_size = 0;
-	int err = 0;
-	struct page *page;
-	dma_addr_t page_dma;
 	struct igb_user_page *userpage;
 
 
@@ -10528,79 +10745,84 @@ static long igb_mapbuf_user(struct file *file, void __user *arg, int ring)
 	if (copy_from_user(&req, arg, buf_cmd_size))
 		return -EFAULT;
 
-	userpage = vzalloc(sizeof(struct igb_user_page));
-	if (unlikely(!userpage)) {
-		err = -ENOMEM;
-		goto failed;
+	userpage = igb_user_page_alloc(igb_priv, 0);
+	if (unlikely(!userpage))
+		return -ENOMEM;
+
+	if(ring == IGB_IOCTL_MAPBUF)
+		req.pa = page_to_phys(userpage->page);
+
+	req.physaddr = userpage->page_dma;
+	req.mmap_size = PAGE_SIZE;
+
+	if (copy_to_user(arg, &req, buf_cmd_size)) {
+		printk("copyout to user failed\n");
+		igb_user_page_free(adapter, userpage);
+		return -EFAULT;
 	}
 
 	mutex_lock(&adapter->lock);
-	if (igb_priv->userpages == NULL) {
-		igb_priv->userpages = userpage;
-	} else {
-		userpage->next = igb_priv->userpages;
-		igb_priv->userpages->prev = userpage;
-		igb_priv->userpages = userpage;
+	hash_add(igb_priv->userpages, &userpage->node, userpage->page_dma);
+	mutex_unlock(&adapter->lock);
+
+	return 0;
+}
+
+/*
+ * Allocate a physically contiguous region of buffers, up to
+ * IGB_REGION_MAX, with a single DMA mapping that user space maps with a
+ * single mmap() at req.pa. Buddy allocations are aligned to their size,
+ * so an IGB_REGION_HUGE region is 2 MB aligned.
+ */
+static long igb_mapregion(struct file *file, void __user *arg)
+{
+	struct igb_private_data *igb_priv = file->private_data;
+	struct igb_adapter *adapter;
+	struct igb_region_cmd req;
+	struct igb_user_page *userpage;
+
+	if (igb_priv == NULL) {
+		printk("cannot find private data!\n");
+		return -ENOENT;
 	}
 
-#if defined(CONFIG_IGB_SUPPORT_32BIT_IOCTL)
-#if defined(CONFIG_ZONE_DMA32)
-	page = alloc_page(GFP_ATOMIC | __GFP_COLD | GFP_DMA32);
-#else /* defined(CONFIG_ZONE_DMA32) */
-	page = alloc_page(GFP_ATOMIC | __GFP_COLD | GFP_DMA);
-#endif /* defined(CONFIG_ZONE_DMA32) */
-#else /* defined(CONFIG_IGB_SUPPORT_32BIT_IOCTL) */
-	page = alloc_page(GFP_ATOMIC | __GFP_COLD);
-#endif /* defined(CONFIG_IGB_SUPPORT_32BIT_IOCTL) */
-	if (unlikely(!page)) {
-		err = -ENOMEM;
-		goto page_failed;
+	adapter = igb_priv->adapter;
+	if (adapter == NULL) {
+		printk("map to unbound device!\n");
+		return -ENOENT;
 	}
 
-	page_dma = dma_map_page(pci_dev_to_dev(adapter->pdev), page,
-			0, PAGE_SIZE, DMA_BIDIRECTIONAL);
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
 
-	if (dma_mapping_error(pci_dev_to_dev(adapter->pdev), page_dma)) {
-		err = -ENOMEM;
-		goto map_failed;
-	}
+	if (req.flags & ~IGB_REGION_HUGE)
+		return -EINVAL;
 
-	igb_priv->userpages->page = page;
-	igb_priv->userpages->page_dma = page_dma;
+	if (req.flags & IGB_REGION_HUGE)
+		req.size = IGB_REGION_MAX;
 
-	if(ring == IGB_IOCTL_MAPBUF)
-		req.pa = page_to_phys(page);
+	if (req.size == 0 || req.size > IGB_REGION_MAX)
+		return -EINVAL;
 
-	req.physaddr = page_dma;
-	req.mmap_size = PAGE_SIZE;
-	mutex_unlock(&adapter->lock);
+	userpage = igb_user_page_alloc(igb_priv, get_order(req.size));
+	if (unlikely(!userpage))
+		return -ENOMEM;
 
-	if (copy_to_user(arg, &req, buf_cmd_size)) {
+	req.physaddr = userpage->page_dma;
+	req.pa = page_to_phys(userpage->page);
+	req.size = PAGE_SIZE << userpage->order;
+
+	if (copy_to_user(arg, &req, sizeof(req))) {
 		printk("copyout to user failed\n");
-		err = -EFAULT;
-		mutex_lock(&adapter->lock);
-		goto copy_failed;
+		igb_user_page_free(adapter, userpage);
+		return -EFAULT;
 	}
 
-	return 0;
-
-copy_failed:
-	dma_unmap_page(pci_dev_to_dev(adapter->pdev),
-			userpage->page_dma, PAGE_SIZE,
-			DMA_BIDIRECTIONAL);
-map_failed:
-	put_page(userpage->page);
-page_failed:
-	if (userpage->prev)
-		userpage->prev->next = userpage->next;
-	if (userpage->next)
-		userpage->next->prev = userpage->prev;
-	if (userpage == igb_priv->userpages)
-		igb_priv->userpages = userpage->next;
-	vfree(userpage);
+	mutex_lock(&adapter->lock);
+	hash_add(igb_priv->userpages, &userpage->node, userpage->page_dma);
 	mutex_unlock(&adapter->lock);
-failed:
-	return err;
+
+	return 0;
 }
 
 static long igb_mapbuf(struct file *file, void __user *arg, int ring)
@@ -10785,6 +11007,7 @@ static long igb_unmapbuf(struct file *file, void __user *arg, int ring)
 
 		adapter->uring_tx_init &= ~(1 << req.queue);
 		igb_priv->uring_tx_init &= ~(1 << req.queue);
+		igb_priv->uring_armed &= ~(1 << IGB_UEVENT_TX(req.queue));
 		mutex_unlock(&adapter->lock);
 	} else if ((ring == IGB_UNMAP_RX_RING) || (ring == IGB_IOCTL_UNMAP_RX_RING)) {
 		/* its easy to figure out what to free on the rings ... */
@@ -10803,48 +11026,414 @@ static long igb_unmapbuf(struct file *file, void __user *arg, int ring)
 
 		adapter->uring_rx_init &= ~(1 << req.queue);
 		igb_priv->uring_rx_init &= ~(1 << req.queue);
+		igb_priv->uring_armed &= ~(1 << IGB_UEVENT_RX(req.queue));
 		mutex_unlock(&adapter->lock);
 	} else {
 		/* have to find the corresponding page to free */
 		struct igb_user_page *userpage;
 
 		mutex_lock(&adapter->lock);
-		userpage = igb_priv->userpages;
-
-		while (userpage != NULL) {
-			if (req.physaddr == userpage->page_dma)
-				break;
-			userpage = userpage->next;
-		}
-
+		userpage = igb_user_page_find(igb_priv, req.physaddr);
 		if (userpage == NULL) {
 			mutex_unlock(&adapter->lock);
 			return -EINVAL;
 		}
 
-		dma_unmap_page(pci_dev_to_dev(adapter->pdev),
-				userpage->page_dma,
-				PAGE_SIZE,
-				DMA_BIDIRECTIONAL);
+		hash_del(&userpage->node);
+		mutex_unlock(&adapter->lock);
 
-		put_page(userpage->page);
+		igb_user_page_free(adapter, userpage);
+	}
+	return err;
+}
 
-		/* take the page out of our list and free it */
-		if (userpage->prev)
-			userpage->prev->next = userpage->next;
+static long igb_numa_node(struct file *file, void __user *arg)
+{
+	struct igb_private_data *igb_priv = file->private_data;
+	struct igb_adapter *adapter;
+	struct igb_node_cmd req;
 
-		if (userpage->next)
-			userpage->next->prev = userpage->prev;
+	if (igb_priv == NULL) {
+		printk("cannot find private data!\n");
+		return -ENOENT;
+	}
 
-		if (userpage == igb_priv->userpages)
-			igb_priv->userpages = userpage->next;
+	adapter = igb_priv->adapter;
+	if (adapter == NULL) {
+		printk("node on unbound device!\n");
+		return -ENOENT;
+	}
 
-		vfree(userpage);
-		mutex_unlock(&adapter->lock);
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	if (req.node != IGB_NODE_DEVICE &&
+	    (req.node < 0 || req.node >= MAX_NUMNODES ||
+	     !node_online(req.node)))
+		return -EINVAL;
+
+	req.dev_node = dev_to_node(pci_dev_to_dev(adapter->pdev));
+	if (req.dev_node < 0)
+		req.dev_node = -1;
+
+	if (copy_to_user(arg, &req, sizeof(req)))
+		return -EFAULT;
+
+	mutex_lock(&adapter->lock);
+	igb_priv->numa_node = req.node == IGB_NODE_DEVICE ?
+			      NUMA_NO_NODE : req.node;
+	mutex_unlock(&adapter->lock);
+
+	return 0;
+}
+
+static long igb_mapbuf_batch(struct file *file, void __user *arg)
+{
+	struct igb_private_data *igb_priv = file->private_data;
+	struct igb_adapter *adapter;
+	struct igb_buf_batch_cmd req;
+	struct igb_user_page **userpages;
+	struct igb_buf_cmd *bufs;
+	u32 i;
+	long err = 0;
+
+	if (igb_priv == NULL) {
+		printk("cannot find private data!\n");
+		return -ENOENT;
+	}
+
+	adapter = igb_priv->adapter;
+	if (adapter == NULL) {
+		printk("map to unbound device!\n");
+		return -ENOENT;
+	}
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	if (req.count == 0 || req.count > IGB_BUF_BATCH_MAX)
+		return -EINVAL;
+
+	bufs = kcalloc(req.count, sizeof(*bufs), GFP_KERNEL);
+	userpages = kcalloc(req.count, sizeof(*userpages), GFP_KERNEL);
+	if (!bufs || !userpages) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	if (copy_from_user(bufs, (void __user *)(uintptr_t)req.bufs,
+			   req.count * sizeof(*bufs))) {
+		err = -EFAULT;
+		goto out;
+	}
+
+	/* a short batch is returned as done < count, like a short write */
+	for (i = 0; i < req.count; i++) {
+		userpages[i] = igb_user_page_alloc(igb_priv, 0);
+		if (unlikely(!userpages[i]))
+			break;
+
+		bufs[i].physaddr = userpages[i]->page_dma;
+		bufs[i].pa = page_to_phys(userpages[i]->page);
+		bufs[i].mmap_size = PAGE_SIZE;
+	}
+	req.done = i;
+
+	if (req.done == 0) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	if (copy_to_user((void __user *)(uintptr_t)req.bufs, bufs,
+			 req.done * sizeof(*bufs)) ||
+	    copy_to_user(arg, &req, sizeof(req))) {
+		printk("copyout to user failed\n");
+		for (i = 0; i < req.done; i++)
+			igb_user_page_free(adapter, userpages[i]);
+		err = -EFAULT;
+		goto out;
 	}
+
+	mutex_lock(&adapter->lock);
+	for (i = 0; i < req.done; i++)
+		hash_add(igb_priv->userpages, &userpages[i]->node,
+			 userpages[i]->page_dma);
+	mutex_unlock(&adapter->lock);
+
+out:
+	kfree(userpages);
+	kfree(bufs);
+	return err;
+}
+
+static long igb_unmapbuf_batch(struct file *file, void __user *arg)
+{
+	struct igb_private_data *igb_priv = file->private_data;
+	struct igb_adapter *adapter;
+	struct igb_buf_batch_cmd req;
+	struct igb_user_page *userpage;
+	struct igb_buf_cmd *bufs;
+	long err = 0;
+
+	if (igb_priv == NULL) {
+		printk("cannot find private data!\n");
+		return -ENOENT;
+	}
+
+	adapter = igb_priv->adapter;
+	if (adapter == NULL) {
+		printk("unmap to unbound device!\n");
+		return -ENOENT;
+	}
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	if (req.count == 0 || req.count > IGB_BUF_BATCH_MAX)
+		return -EINVAL;
+
+	bufs = kcalloc(req.count, sizeof(*bufs), GFP_KERNEL);
+	if (!bufs)
+		return -ENOMEM;
+
+	if (copy_from_user(bufs, (void __user *)(uintptr_t)req.bufs,
+			   req.count * sizeof(*bufs))) {
+		err = -EFAULT;
+		goto out;
+	}
+
+	/* stops at the first address not mapped through this file */
+	mutex_lock(&adapter->lock);
+	for (req.done = 0; req.done < req.count; req.done++) {
+		userpage = igb_user_page_find(igb_priv,
+					      bufs[req.done].physaddr);
+		if (userpage == NULL) {
+			err = -EINVAL;
+			break;
+		}
+		hash_del(&userpage->node);
+		igb_user_page_free(adapter, userpage);
+	}
+	mutex_unlock(&adapter->lock);
+
+	if (copy_to_user(arg, &req, sizeof(req)))
+		err = -EFAULT;
+out:
+	kfree(bufs);
 	return err;
 }
 
+static void igb_user_pin_free(struct igb_adapter *adapter,
+			      struct igb_user_pin *userpin)
+{
+	dma_unmap_sg(pci_dev_to_dev(adapter->pdev), userpin->sgt.sgl,
+		     userpin->sgt.orig_nents, userpin->dir);
+	sg_free_table(&userpin->sgt);
+	unpin_user_pages_dirty_lock(userpin->pages, userpin->npages,
+				    userpin->dir != DMA_TO_DEVICE);
+	account_locked_vm(userpin->mm, userpin->npages, false);
+	mmdrop(userpin->mm);
+	kfree(userpin->pages);
+	kfree(userpin);
+}
+
+static long igb_pin(struct file *file, void __user *arg)
+{
+	struct igb_private_data *igb_priv = file->private_data;
+	struct igb_adapter *adapter;
+	struct igb_user_pin *userpin;
+	struct igb_pin_cmd req;
+	struct scatterlist *sg;
+	unsigned int offset, npages, len, i, k;
+	unsigned long start;
+	dma_addr_t dma;
+	u64 *bufs = NULL;
+	int pinned, nents;
+	long err;
+
+	if (igb_priv == NULL) {
+		printk("cannot find private data!\n");
+		return -ENOENT;
+	}
+
+	adapter = igb_priv->adapter;
+	if (adapter == NULL) {
+		printk("pin to unbound device!\n");
+		return -ENOENT;
+	}
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	if ((req.flags & ~IGB_PIN_WRITE) || req.len == 0 ||
+	    req.len > (u64)IGB_PIN_MAX_PAGES * PAGE_SIZE ||
+	    req.addr + req.len < req.addr)
+		return -EINVAL;
+
+	offset = offset_in_page(req.addr);
+	start = req.addr - offset;
+	npages = DIV_ROUND_UP(offset + (unsigned long)req.len, PAGE_SIZE);
+	if (npages > IGB_PIN_MAX_PAGES)
+		return -EINVAL;
+
+	if (npages > req.npages) {
+		req.npages = npages;
+		if (copy_to_user(arg, &req, sizeof(req)))
+			return -EFAULT;
+		return -ENOSPC;
+	}
+
+	userpin = kzalloc(sizeof(*userpin), GFP_KERNEL);
+	if (!userpin)
+		return -ENOMEM;
+
+	userpin->pages = kcalloc(npages, sizeof(struct page *), GFP_KERNEL);
+	bufs = kcalloc(npages, sizeof(*bufs), GFP_KERNEL);
+	if (!userpin->pages || !bufs) {
+		err = -ENOMEM;
+		goto err_alloc;
+	}
+
+	userpin->dir = (req.flags & IGB_PIN_WRITE) ? DMA_BIDIRECTIONAL :
+						     DMA_TO_DEVICE;
+
+	/* long-term pins count against RLIMIT_MEMLOCK, as with vfio or RDMA */
+	err = account_locked_vm(current->mm, npages, true);
+	if (err)
+		goto err_alloc;
+	userpin->mm = current->mm;
+	mmgrab(userpin->mm);
+
+	pinned = pin_user_pages_fast(start, npages, FOLL_LONGTERM |
+			((req.flags & IGB_PIN_WRITE) ? FOLL_WRITE : 0),
+			userpin->pages);
+	if (pinned < 0) {
+		err = pinned;
+		goto err_account;
+	}
+	userpin->npages = pinned;
+	if (pinned != npages) {
+		err = -EFAULT;
+		goto err_pin;
+	}
+
+	err = sg_alloc_table_from_pages(&userpin->sgt, userpin->pages, npages,
+					offset, req.len, GFP_KERNEL);
+	if (err)
+		goto err_pin;
+
+	nents = dma_map_sg(pci_dev_to_dev(adapter->pdev), userpin->sgt.sgl,
+			   userpin->sgt.orig_nents, userpin->dir);
+	if (nents <= 0) {
+		err = -ENOMEM;
+		goto err_sg;
+	}
+
+	/*
+	 * the range stays mapped while the application writes it, nothing
+	 * syncs it for the device: refuse mappings that bounce (swiotlb)
+	 * or need cache maintenance
+	 */
+	for_each_sg(userpin->sgt.sgl, sg, nents, k) {
+		if (dma_need_sync(pci_dev_to_dev(adapter->pdev),
+				  sg_dma_address(sg))) {
+			err = -EOPNOTSUPP;
+			goto err_map;
+		}
+	}
+
+	/*
+	 * an IOMMU may merge the segments; either way each one but the
+	 * first starts on a page boundary, so walk them a page at a time
+	 */
+	i = 0;
+	for_each_sg(userpin->sgt.sgl, sg, nents, k) {
+		dma = sg_dma_address(sg);
+		len = sg_dma_len(sg);
+		if (k == 0) {
+			dma -= offset;
+			len += offset;
+		}
+		for (; len > 0 && i < npages; i++) {
+			bufs[i] = dma;
+			dma += PAGE_SIZE;
+			len -= min_t(unsigned int, len, PAGE_SIZE);
+		}
+	}
+
+	mutex_lock(&adapter->lock);
+	userpin->handle = ++igb_priv->pin_seq;
+	mutex_unlock(&adapter->lock);
+
+	req.handle = userpin->handle;
+	req.npages = npages;
+	if (copy_to_user((void __user *)(uintptr_t)req.bufs, bufs,
+			 npages * sizeof(*bufs)) ||
+	    copy_to_user(arg, &req, sizeof(req))) {
+		printk("copyout to user failed\n");
+		err = -EFAULT;
+		goto err_map;
+	}
+
+	mutex_lock(&adapter->lock);
+	list_add(&userpin->list, &igb_priv->userpins);
+	mutex_unlock(&adapter->lock);
+
+	kfree(bufs);
+	return 0;
+
+err_map:
+	dma_unmap_sg(pci_dev_to_dev(adapter->pdev), userpin->sgt.sgl,
+		     userpin->sgt.orig_nents, userpin->dir);
+err_sg:
+	sg_free_table(&userpin->sgt);
+err_pin:
+	unpin_user_pages(userpin->pages, userpin->npages);
+err_account:
+	account_locked_vm(userpin->mm, npages, false);
+	mmdrop(userpin->mm);
+err_alloc:
+	kfree(bufs);
+	kfree(userpin->pages);
+	kfree(userpin);
+	return err;
+}
+
+static long igb_unpin(struct file *file, void __user *arg)
+{
+	struct igb_private_data *igb_priv = file->private_data;
+	struct igb_adapter *adapter;
+	struct igb_user_pin *userpin;
+	struct igb_pin_cmd req;
+
+	if (igb_priv == NULL) {
+		printk("cannot find private data!\n");
+		return -ENOENT;
+	}
+
+	adapter = igb_priv->adapter;
+	if (adapter == NULL) {
+		printk("unpin to unbound device!\n");
+		return -ENOENT;
+	}
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	mutex_lock(&adapter->lock);
+	list_for_each_entry(userpin, &igb_priv->userpins, list) {
+		if (userpin->handle == req.handle) {
+			list_del(&userpin->list);
+			mutex_unlock(&adapter->lock);
+			igb_user_pin_free(adapter, userpin);
+			return 0;
+		}
+	}
+	mutex_unlock(&adapter->lock);
+
+	return -EINVAL;
+}
+
 static long igb_ioctl_file(struct file *file, unsigned int cmd, 
 			   unsigned long arg)
 {
@@ -10879,6 +11468,27 @@ static long igb_ioctl_file(struct file *file, unsigned int cmd,
 	case IGB_LINKSPEED:
 		err = igb_getspeed(file, argp);
 		break;
+	case IGB_IOCTL_ARM:
+		err = igb_arm(file, argp);
+		break;
+	case IGB_IOCTL_MAPREGION:
+		err = igb_mapregion(file, argp);
+		break;
+	case IGB_IOCTL_MAPBUF_BATCH:
+		err = igb_mapbuf_batch(file, argp);
+		break;
+	case IGB_IOCTL_UNMAPBUF_BATCH:
+		err = igb_unmapbuf_batch(file, argp);
+		break;
+	case IGB_IOCTL_NUMA_NODE:
+		err = igb_numa_node(file, argp);
+		break;
+	case IGB_IOCTL_PIN:
+		err = igb_pin(file, argp);
+		break;
+	case IGB_IOCTL_UNPIN:
+		err = igb_unpin(file, argp);
+		break;
 	default:
 		err = -EINVAL;
 		break;
@@ -10899,7 +11509,10 @@ static int igb_open_file(struct inode *inode, struct file *file)
        }
        igb_priv->uring_tx_init = 0;
        igb_priv->uring_rx_init = 0;
-       igb_priv->userpages = NULL;
+       igb_priv->uring_armed = 0;
+       igb_priv->numa_node = NUMA_NO_NODE;
+       INIT_LIST_HEAD(&igb_priv->userpins);
+       hash_init(igb_priv->userpages);
        igb_priv->adapter = NULL;
 out:
        file->private_data = igb_priv;
@@ -10912,6 +11525,9 @@ static int igb_close_file(struct inode *inode, struct file *file)
 	struct igb_adapter *adapter = NULL;
 	int err = 0;
 	struct igb_user_page *userpage;
+	struct igb_user_pin *userpin, *nextpin;
+	struct hlist_node *tmp;
+	int bkt;
 
 	if (igb_priv == NULL) {
 		printk("cannot find private data!\n");
@@ -10933,28 +11549,14 @@ static int igb_close_file(struct inode *inode, struct file *file)
 		igb_free_all_rx_resources(adapter);
 	}
 
-	userpage = igb_priv->userpages;
-
-	while (userpage != NULL) {
-		dma_unmap_page(pci_dev_to_dev(adapter->pdev),
-						userpage->page_dma,
-						PAGE_SIZE,
-						DMA_BIDIRECTIONAL);
-
-		put_page(userpage->page);
-
-		/* take the page out of our list and free it */
-		if (userpage->prev)
-			userpage->prev->next = userpage->next;
-
-		if (userpage->next)
-			userpage->next->prev = userpage->prev;
-
-		if (userpage == igb_priv->userpages)
-			igb_priv->userpages = userpage->next;
+	hash_for_each_safe(igb_priv->userpages, bkt, tmp, userpage, node) {
+		hash_del(&userpage->node);
+		igb_user_page_free(adapter, userpage);
+	}
 
-		vfree(userpage);
-		userpage = igb_priv->userpages;
+	list_for_each_entry_safe(userpin, nextpin, &igb_priv->userpins, list) {
+		list_del(&userpin->list);
+		igb_user_pin_free(adapter, userpin);
 	}
 	mutex_unlock(&adapter->lock);
 
@@ -4707,6 +4707,13 @@ static inline bool page_is_pfmemalloc(struct page __maybe_unused *page)
 #define HAVE_GENEVE_RX_OFFLOAD
 #endif /* 4.5.0 */
 
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,11,0))
+#define mmgrab(mm) atomic_inc(&(mm)->mm_count)
+#else
+#include <linux/sched/mm.h>
+#include <linux/sched/signal.h>
+#endif /* 4.11.0 */
+
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(4,16,0))
 #ifndef sizeof_field
 #define sizeof_field(t, f) (sizeof(((t*)0)->f))
@@ -4734,6 +4741,35 @@ static inline bool page_is_pfmemalloc(struct page __maybe_unused *page)
 #define HAVE_NDO_SELECT_FALLBACK
 #endif /* 5.2.0 */
 
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5,3,0))
+static inline int _kc_account_locked_vm(struct mm_struct *mm,
+					unsigned long pages, bool inc)
+{
+	unsigned long locked;
+	int ret = 0;
+
+	if (pages == 0 || !mm)
+		return 0;
+
+	down_write(&mm->mmap_sem);
+	if (inc) {
+		locked = mm->locked_vm + pages;
+		if (locked > rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT &&
+		    !capable(CAP_IPC_LOCK))
+			ret = -ENOMEM;
+		else
+			mm->locked_vm = locked;
+	} else {
+		mm->locked_vm -= min(pages, mm->locked_vm);
+	}
+	up_write(&mm->mmap_sem);
+
+	return ret;
+}
+#define account_locked_vm(_mm, _pages, _inc) \
+	_kc_account_locked_vm(_mm, _pages, _inc)
+#endif /* 5.3.0 */
+
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(5,4,0))
 typedef struct skb_frag_struct skb_frag_t;
 
@@ -4743,6 +4779,36 @@ static inline void skb_frag_off_add(skb_frag_t *frag, int delta)
 }
 #endif /* 5.4.0 */
 
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5,6,0))
+#ifndef FOLL_LONGTERM
+#define FOLL_LONGTERM 0
+#endif
+/*
+ * Without FOLL_LONGTERM a read-only pin is a plain reference that a
+ * copy-on-write fault after fork() separates from the process' page,
+ * so long-term pins always break COW up front by pinning for write.
+ */
+#define pin_user_pages_fast(start, nr_pages, gup_flags, pages) \
+	get_user_pages_fast(start, nr_pages, FOLL_WRITE, pages)
+
+static inline void _kc_unpin_user_pages_dirty_lock(struct page **pages,
+						   unsigned long npages,
+						   bool make_dirty)
+{
+	unsigned long i;
+
+	for (i = 0; i < npages; i++) {
+		if (make_dirty)
+			set_page_dirty_lock(pages[i]);
+		put_page(pages[i]);
+	}
+}
+#define unpin_user_pages_dirty_lock(_pages, _npages, _dirty) \
+	_kc_unpin_user_pages_dirty_lock(_pages, _npages, _dirty)
+#define unpin_user_pages(_pages, _npages) \
+	_kc_unpin_user_pages_dirty_lock(_pages, _npages, false)
+#endif /* 5.6.0 */
+
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(5,7,0))
 #define pci_aer_clear_nonfatal_status(x) pci_cleanup_aer_uncorrect_error_status(x)
 #endif /* 5.7.0 */
@@ -4751,6 +4817,11 @@ static inline void skb_frag_off_add(skb_frag_t *frag, int delta)
 #define HAVE_ETHTOOL_COALESCE_PARAMS
 #endif /* 5.7.0 */
 
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0))
+/* no way to tell whether a mapping bounces, assume it does */
+#define dma_need_sync(dev, dma_addr) true
+#endif /* 5.8.0 */
+
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(5,15,0))
 #define HAVE_ETHTOOL_COALESCE_EXT
 #define HAVE_NDO_ETH_IOCTL
@@ -380,6 +380,14 @@ struct e1000_adv_tx_context_desc {
 #define E1000_ETQF_IMM_INT		(1 << 29)
 #define E1000_ETQF_1588			(1 << 30)
 #define E1000_ETQF_QUEUE_ENABLE		(1 << 31)
+#define E1000_ETQF_ETYPE_MASK		0x0000FFFF
+#define E1000_ETQF_QUEUE_SHIFT		16
+#define E1000_ETQF_QUEUE_MASK		0x00070000
+
+/* VLAPQF register bit definitions, 4 bits per VLAN priority */
+#define E1000_VLAPQF_QUEUE_SEL(_n, q_idx)	((q_idx) << ((_n) * 4))
+#define E1000_VLAPQF_P_VALID(_n)	(0x1 << (3 + (_n) * 4))
+#define E1000_VLAPQF_QUEUE_MASK		0x03
 /*
  * ETQF filter list: one static filter per filter consumer. This is
  *                   to avoid filter collisions later. Add new filters
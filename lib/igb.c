@@ -47,9 +47,13 @@
 #include <sys/mman.h>
 #include <sys/user.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <stdint.h>
 #include <semaphore.h>
 #include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "e1000_hw.h"
 #include "e1000_82575.h"
@@ -98,11 +102,20 @@ static void igb_setup_receive_structures(struct adapter *adapter);
 static void igb_setup_transmit_ring(struct tx_ring *txr);
 static void igb_initialize_transmit_units(struct adapter *adapter);
 static void igb_initialize_receive_units(struct adapter *adapter);
+static u32 igb_rx_srrctl(struct rx_ring *rxr);
+static void igb_rx_pool_reclaim_ring(struct rx_ring *rxr);
+static unsigned int igb_rx_pool_fill(struct rx_ring *rxr);
+static void igb_rx_pool_destroy(device_t *dev, struct igb_rx_pool *pool);
 static void igb_free_transmit_structures(struct adapter *adapter);
 static void igb_free_receive_structures(struct adapter *adapter);
-static void igb_tx_ctx_setup(struct tx_ring *txr, struct igb_packet *packet);
+static int  igb_tx_ctx_setup(struct tx_ring *txr, struct igb_packet *packet,
+			     int ctxd);
 static void igb_free_receive_buffers(struct rx_ring *rxr);
-static int  igb_create_lock(struct adapter *adapter);
+static int  igb_lock_queue(struct tx_ring *txr);
+static void igb_unlock_queue(struct tx_ring *txr);
+static int  igb_lock_tx_queues(struct adapter *adapter);
+static void igb_unlock_tx_queues(struct adapter *adapter);
+static int  igb_create_lock(struct adapter *adapter, const char *dev_path);
 
 int igb_probe(device_t *dev)
 {
@@ -127,12 +140,18 @@ int igb_probe(device_t *dev)
 	return -ENXIO;
 }
 
+/*
+ * Each adapter gets its own lock domain, named after its PCI address,
+ * e.g. "/igb_sem.0000:01:00.0", so libigb users on different ports do
+ * not serialize against each other.
+ */
 #define IGB_SEM "/igb_sem"
 
 int igb_attach(char *dev_path, device_t *pdev)
 {
 	struct adapter *adapter;
 	struct igb_bind_cmd	bind = {0};
+	struct igb_node_cmd	node;
 	int error = 0;
 	bool locked = false;
 
@@ -160,7 +179,7 @@ int igb_attach(char *dev_path, device_t *pdev)
 		goto err_prebind;
 	}
 
-	if (igb_create_lock(adapter) != 0) {
+	if (igb_create_lock(adapter, dev_path) != 0) {
 		error = -errno;
 		goto err_bind;
 	}
@@ -188,6 +207,26 @@ int igb_attach(char *dev_path, device_t *pdev)
 	adapter->csr.paddr = 0;
 	adapter->csr.mmap_size = bind.mmap_size;
 
+	/* buffers and packet metadata default to the NIC's node */
+	node.node = IGB_NODE_DEVICE;
+	node.dev_node = -1;
+	if (ioctl(adapter->ldev, IGB_IOCTL_NUMA_NODE, &node) == 0)
+		adapter->numa_ioctl = 1;
+	else
+		node.dev_node = -1;
+	adapter->dev_node = node.dev_node;
+	adapter->numa_node = node.dev_node;
+
+	/*
+	 * Modules that know an ioctl fault on a NULL argument, older ones
+	 * reject the command itself with EINVAL.
+	 */
+	if (ioctl(adapter->ldev, IGB_IOCTL_MAPREGION, NULL) < 0 &&
+	    errno == EFAULT)
+		adapter->region_ioctl = 1;
+	if (ioctl(adapter->ldev, IGB_IOCTL_PIN, NULL) < 0 && errno == EFAULT)
+		adapter->pin_ioctl = 1;
+
 	/* Determine hardware and mac info */
 	adapter->hw.vendor_id = pdev->pci_vendor_id;
 	adapter->hw.device_id = pdev->pci_vendor_id;
@@ -231,8 +270,9 @@ err_pci:
 err_bind:
 	if (locked)
 		(void) igb_unlock(pdev);
-	if (adapter && adapter->memlock) {
-		(void) munmap(adapter->memlock, sizeof(pthread_mutex_t));
+	if (adapter && adapter->locks) {
+		(void) munmap(adapter->locks, sizeof(struct igb_lock_domain));
+		adapter->locks = NULL;
 		adapter->memlock = NULL;
 	}
 	close(adapter->ldev);
@@ -318,6 +358,7 @@ release:
 int igb_detach(device_t *dev)
 {
 	struct adapter *adapter;
+	int i;
 
 	if (dev == NULL)
 		return -EINVAL;
@@ -325,6 +366,39 @@ int igb_detach(device_t *dev)
 	if (adapter == NULL)
 		return -ENXIO;
 
+	if (igb_lock(dev) != 0)
+		goto err_nolock;
+
+	if (igb_lock_tx_queues(adapter) != 0) {
+		igb_unlock(dev);
+		goto err_nolock;
+	}
+
+	igb_reset(adapter);
+
+	/* igb_reset() turned head write-back off */
+	for (i = 0; adapter->tx_rings && i < adapter->num_queues; i++)
+		adapter->tx_rings[i].head_wb = NULL;
+
+	igb_unlock_tx_queues(adapter);
+	igb_unlock(dev);
+
+	/*
+	 * Release the head write-back page and the receive buffer pools
+	 * while the adapter is still active: freeing DMA memory takes
+	 * igb_lock() to reach the kernel module.
+	 */
+	if (adapter->txhwb.dma_vaddr)
+		igb_dma_free_page(dev, &adapter->txhwb);
+
+	/* the receive queues are stopped, release the buffer pools */
+	for (i = 0; adapter->rx_rings && i < adapter->num_queues; i++) {
+		if (adapter->rx_rings[i].pool) {
+			igb_rx_pool_destroy(dev, adapter->rx_rings[i].pool);
+			adapter->rx_rings[i].pool = NULL;
+		}
+	}
+
 	if (igb_lock(dev) != 0)
 		goto err_nolock;
 
@@ -335,8 +409,6 @@ int igb_detach(device_t *dev)
 	 */
 	adapter->active = 0;
 
-	igb_reset(adapter);
-
 	igb_unlock(dev);
 
 	igb_free_pci_resources(adapter);
@@ -348,11 +420,11 @@ int igb_detach(device_t *dev)
 		igb_free_receive_structures(adapter);
 
 err_nolock:
-	if (adapter->memlock) {
+	if (adapter->locks) {
 		/*
 		 * Do not unmap the shared memory region holding the pthread mutex.
 		 *
-		 * (void) munmap(adapter->memlock, sizeof(pthread_mutex_t));
+		 * (void) munmap(adapter->locks, sizeof(struct igb_lock_domain));
 		 *
 		 * The pthread mutex is configured as a robust type mutex so that
 		 * it can automatically be unlocked on process termination if needed.
@@ -364,6 +436,7 @@ err_nolock:
 		 * The mapped regions will automatically be unmapped at the end of
 		 * the process termination.
 		 */
+		adapter->locks = NULL;
 		adapter->memlock = NULL;
 	}
 
@@ -380,7 +453,7 @@ int igb_suspend(device_t *dev)
 	struct tx_ring *txr;
 	struct rx_ring *rxr;
 	struct e1000_hw *hw;
-	u32 txdctl, srrctl = 0;
+	u32 txdctl;
 	int i;
 
 	if (dev == NULL)
@@ -398,6 +471,11 @@ int igb_suspend(device_t *dev)
 	if (igb_lock(dev) != 0)
 		return errno;
 
+	if (igb_lock_tx_queues(adapter) != 0) {
+		igb_unlock(dev);
+		return -ENXIO;
+	}
+
 	/* stop but don't reset the Tx Descriptor Rings */
 	for (i = 0; i < adapter->num_queues; i++, txr++) {
 		txdctl |= IGB_TX_PTHRESH;
@@ -407,9 +485,6 @@ int igb_suspend(device_t *dev)
 		txr->queue_status = IGB_QUEUE_IDLE;
 	}
 
-	srrctl |= 2048 >> E1000_SRRCTL_BSIZEPKT_SHIFT;
-	srrctl |= E1000_SRRCTL_DESCTYPE_ADV_ONEBUF;
-
 	for (i = 0; i < adapter->num_queues; i++, rxr++) {
 		u64 bus_addr = rxr->rxdma.paddr;
 		u32 rxdctl;
@@ -421,7 +496,7 @@ int igb_suspend(device_t *dev)
 				(uint32_t)(bus_addr >> 32));
 		E1000_WRITE_REG(hw, E1000_RDBAL(i),
 				(uint32_t)bus_addr);
-		E1000_WRITE_REG(hw, E1000_SRRCTL(i), srrctl);
+		E1000_WRITE_REG(hw, E1000_SRRCTL(i), igb_rx_srrctl(rxr));
 		/* Enable this Queue */
 		rxdctl = E1000_READ_REG(hw, E1000_RXDCTL(i));
 		rxdctl |= E1000_RXDCTL_QUEUE_ENABLE;
@@ -432,6 +507,8 @@ int igb_suspend(device_t *dev)
 		E1000_WRITE_REG(hw, E1000_RXDCTL(i), rxdctl);
 	}
 
+	igb_unlock_tx_queues(adapter);
+
 	if (igb_unlock(dev) != 0)
 		return errno;
 
@@ -444,7 +521,7 @@ int igb_resume(device_t *dev)
 	struct tx_ring *txr;
 	struct rx_ring *rxr;
 	struct e1000_hw *hw;
-	u32 txdctl, srrctl = 0;
+	u32 txdctl;
 	int i;
 
 	if (dev == NULL)
@@ -462,6 +539,11 @@ int igb_resume(device_t *dev)
 	if (igb_lock(dev) != 0)
 		return errno;
 
+	if (igb_lock_tx_queues(adapter) != 0) {
+		igb_unlock(dev);
+		return -ENXIO;
+	}
+
 	/* resume but don't reset the Tx Descriptor Rings */
 	for (i = 0; i < adapter->num_queues; i++, txr++) {
 		/* idle the queue */
@@ -474,9 +556,6 @@ int igb_resume(device_t *dev)
 		txr->queue_status = IGB_QUEUE_WORKING;
 	}
 
-	srrctl |= 2048 >> E1000_SRRCTL_BSIZEPKT_SHIFT;
-	srrctl |= E1000_SRRCTL_DESCTYPE_ADV_ONEBUF;
-
 	for (i = 0; i < adapter->num_queues; i++, rxr++) {
 		u64 bus_addr = rxr->rxdma.paddr;
 		u32 rxdctl;
@@ -488,7 +567,7 @@ int igb_resume(device_t *dev)
 				(uint32_t)(bus_addr >> 32));
 		E1000_WRITE_REG(hw, E1000_RDBAL(i),
 				(uint32_t)bus_addr);
-		E1000_WRITE_REG(hw, E1000_SRRCTL(i), srrctl);
+		E1000_WRITE_REG(hw, E1000_SRRCTL(i), igb_rx_srrctl(rxr));
 		/* Enable this Queue */
 		rxdctl = E1000_READ_REG(hw, E1000_RXDCTL(i));
 		rxdctl |= E1000_RXDCTL_QUEUE_ENABLE;
@@ -499,6 +578,8 @@ int igb_resume(device_t *dev)
 		E1000_WRITE_REG(hw, E1000_RXDCTL(i), rxdctl);
 	}
 
+	igb_unlock_tx_queues(adapter);
+
 	if (igb_unlock(dev) != 0)
 		return errno;
 
@@ -518,6 +599,11 @@ int igb_init(device_t *dev)
 	if (igb_lock(dev) != 0)
 		return errno;
 
+	if (igb_lock_tx_queues(adapter) != 0) {
+		igb_unlock(dev);
+		return -ENXIO;
+	}
+
 	igb_reset(adapter);
 
 	/* Prepare transmit descriptors and buffers */
@@ -531,6 +617,8 @@ int igb_init(device_t *dev)
 		igb_initialize_receive_units(adapter);
 	}
 
+	igb_unlock_tx_queues(adapter);
+
 	if (igb_unlock(dev) != 0)
 		return errno;
 
@@ -543,10 +631,9 @@ igb_reset(struct adapter *adapter)
 	struct tx_ring *txr = adapter->tx_rings;
 	struct rx_ring *rxr = adapter->rx_rings;
 	struct e1000_hw *hw = &adapter->hw;
-	u32 txdctl, srrctl;
+	u32 txdctl;
 	int i;
 
-	srrctl = 0;
 	txdctl = 0;
 
 	/* Set up the Tx Descriptor Rings, leave queues idle */
@@ -573,6 +660,10 @@ igb_reset(struct adapter *adapter)
 			E1000_WRITE_REG(hw, E1000_TDBAL(i),
 					(u_int32_t)bus_addr);
 
+			/* no head write-back until the transmit units are up */
+			E1000_WRITE_REG(hw, E1000_TDWBAL(i), 0);
+			E1000_WRITE_REG(hw, E1000_TDWBAH(i), 0);
+
 			/* Setup the HW Tx Head and Tail descriptor pointers */
 			E1000_WRITE_REG(hw, E1000_TDT(i), 0);
 			E1000_WRITE_REG(hw, E1000_TDH(i), 0);
@@ -581,9 +672,6 @@ igb_reset(struct adapter *adapter)
 		}
 	}
 
-	srrctl |= 2048 >> E1000_SRRCTL_BSIZEPKT_SHIFT;
-	srrctl |= E1000_SRRCTL_DESCTYPE_ADV_ONEBUF;
-
 	/* Setup the Base and Length of the Rx Descriptor Rings */
 	if (adapter->rx_rings == NULL) {
 #if DEBUG
@@ -608,7 +696,7 @@ igb_reset(struct adapter *adapter)
 					(uint32_t)(bus_addr >> 32));
 			E1000_WRITE_REG(hw, E1000_RDBAL(i),
 					(uint32_t)bus_addr);
-			E1000_WRITE_REG(hw, E1000_SRRCTL(i), srrctl);
+			E1000_WRITE_REG(hw, E1000_SRRCTL(i), igb_rx_srrctl(rxr));
 
 			/* Enable this Queue */
 			rxdctl = E1000_READ_REG(hw, E1000_RXDCTL(i));
@@ -751,920 +839,3755 @@ err:
 	return;
 }
 
-/*********************************************************************
- *
- *  Allocate memory for the transmit rings, and then
- *  the descriptors associated with each, called only once at attach.
- *
- **********************************************************************/
-static int igb_allocate_queues(struct adapter *adapter)
+/*
+ * Allocate a physically contiguous DMA region of at least size bytes,
+ * up to IGB_DMA_REGION_MAX, or with IGB_DMA_HUGE a whole 2 MB aligned
+ * IGB_DMA_REGION_MAX. It takes one ioctl and one mapping where
+ * igb_dma_malloc_page() would take one of each per page. Released with
+ * igb_dma_free_page(). Returns -ENOTTY if the kernel module predates
+ * regions.
+ */
+int igb_dma_malloc_region(device_t *dev, struct igb_dma_alloc *dma,
+			  unsigned int size, int flags)
 {
-	struct igb_buf_cmd ubuf = {0};
-	int dev = adapter->ldev;
-	int i, error = 0;
+	struct igb_region_cmd ureg = {0};
+	struct adapter *adapter;
+	int error = 0;
 
-	/* allocate the TX ring struct memory */
-	adapter->tx_rings = (struct tx_ring *) malloc(sizeof(struct tx_ring) *
-						      adapter->num_queues);
+	if (dev == NULL || dma == NULL)
+		return -EINVAL;
 
-	if (adapter->tx_rings == NULL) {
-		error = -ENOMEM;
-		goto tx_fail;
-	}
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
+		return -ENXIO;
 
-	memset(adapter->tx_rings, 0, sizeof(struct tx_ring) *
-					    adapter->num_queues);
+	if (flags & ~IGB_DMA_HUGE)
+		return -EINVAL;
 
-	for (i = 0; i < adapter->num_queues; i++) {
-		ubuf.queue = i;
-		error = ioctl(dev, IGB_IOCTL_MAPRING, &ubuf);
-		if (error < 0) {
-			if(error == -EINVAL)
-				goto tx_fail;
+	if (!(flags & IGB_DMA_HUGE) &&
+	    (size == 0 || size > IGB_DMA_REGION_MAX))
+		return -EINVAL;
 
-			error = EBUSY;
-			goto tx_desc;
-		}
+	if (!adapter->region_ioctl)
+		return -ENOTTY;
 
-		if (ubuf.physaddr % 128)
-			printf("warning: tx ring addr (0x%lx) is not a 128 byte-aligned\n",
-				ubuf.physaddr);
+	ureg.size = size;
+	ureg.flags = (flags & IGB_DMA_HUGE) ? IGB_REGION_HUGE : 0;
 
-		adapter->tx_rings[i].txdma.paddr = ubuf.physaddr;
-		adapter->tx_rings[i].txdma.mmap_size = ubuf.mmap_size;
-		adapter->tx_rings[i].tx_base = NULL;
-		adapter->tx_rings[i].tx_base =
-			(struct e1000_tx_desc *)mmap(NULL, ubuf.mmap_size,
-						     PROT_READ | PROT_WRITE,
-						     MAP_SHARED, adapter->ldev,
-						     ubuf.pa);
+	error = igb_lock(dev);
+	if (error)
+		return error;
 
-		if (adapter->tx_rings[i].tx_base == MAP_FAILED) {
-			error = -ENOMEM;
-			goto tx_desc;
-		}
+	if (ioctl(adapter->ldev, IGB_IOCTL_MAPREGION, &ureg) < 0)
+		error = -errno;
 
-		adapter->tx_rings[i].adapter = adapter;
-		adapter->tx_rings[i].me = i;
-		/* XXX Initialize a TX lock ?? */
-		adapter->num_tx_desc = ubuf.mmap_size /
-				       sizeof(union e1000_adv_tx_desc);
+	if (igb_unlock(dev) != 0 && error == 0)
+		error = -errno;
 
-		/*
-		 * num_tx_desc must be always a multiple of 8 because the value of
-		 * TDLEN must be a multipe of 128 and each descriptor has 16 bytes.
-		 */
-		if (adapter->num_tx_desc % 8)
-			printf("warning: num_tx_desc(%d) is not a multiple of 8\n",
-				adapter->num_tx_desc);
+	if (error != 0)
+		return error;
 
-		memset((void *)adapter->tx_rings[i].tx_base, 0, ubuf.mmap_size);
-		adapter->tx_rings[i].tx_buffers =
-			(struct igb_tx_buffer *)
-				malloc(sizeof(struct igb_tx_buffer) *
-				       adapter->num_tx_desc);
+	dma->dma_vaddr = mmap(NULL, ureg.size, PROT_READ | PROT_WRITE,
+			      MAP_SHARED, adapter->ldev, ureg.pa);
+	if (dma->dma_vaddr == MAP_FAILED) {
+		struct igb_buf_cmd ubuf = {0};
 
-		if (adapter->tx_rings[i].tx_buffers == NULL) {
-			error = -ENOMEM;
-			goto tx_desc;
+		ubuf.physaddr = ureg.physaddr;
+		if (igb_lock(dev) == 0) {
+			ioctl(adapter->ldev, IGB_IOCTL_UNMAPBUF, &ubuf);
+			igb_unlock(dev);
 		}
-
-		memset(adapter->tx_rings[i].tx_buffers, 0,
-		       sizeof(struct igb_tx_buffer) * adapter->num_tx_desc);
+		dma->dma_vaddr = NULL;
+		return -ENOMEM;
 	}
 
-	return 0;
+	dma->dma_paddr = ureg.physaddr;
+	dma->mmap_size = ureg.size;
 
-tx_desc:
-	for (i = 0; i < adapter->num_queues; i++) {
-		if (adapter->tx_rings[i].tx_base)
-			munmap(adapter->tx_rings[i].tx_base,
-			       adapter->tx_rings[i].txdma.mmap_size);
-		ubuf.queue = i;
-		ioctl(dev, IGB_IOCTL_UNMAPRING, &ubuf);
-	};
-tx_fail:
-	free(adapter->tx_rings);
-	adapter->tx_rings = NULL;
-	return error;
+	return 0;
 }
 
-/* Initialize a transmit ring. */
-static void igb_setup_transmit_ring(struct tx_ring *txr)
+/*
+ * Allocate num_pages single pages, as igb_dma_malloc_page() would, with
+ * one ioctl per IGB_BUF_BATCH_MAX pages instead of one per page. Either
+ * all pages are allocated or none. Falls back to one ioctl per page with
+ * kernel modules that predate batching.
+ */
+int igb_dma_malloc_pages(device_t *dev, struct igb_dma_alloc *pages,
+			 unsigned int num_pages)
 {
-	struct adapter *adapter = txr->adapter;
+	struct igb_buf_cmd ubufs[IGB_BUF_BATCH_MAX];
+	struct igb_buf_batch_cmd batch;
+	struct adapter *adapter;
+	unsigned int i, n = 0;
+	int error = 0;
 
-	/* Clear the old descriptor contents */
-	memset((void *)txr->tx_base,  0,
-	       (sizeof(union e1000_adv_tx_desc)) * adapter->num_tx_desc);
+	if (dev == NULL || pages == NULL)
+		return -EINVAL;
 
-	memset(txr->tx_buffers, 0, sizeof(struct igb_tx_buffer) *
-				   txr->adapter->num_tx_desc);
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
+		return -ENXIO;
 
-	/* Reset indices */
-	txr->next_avail_desc = 0;
-	txr->next_to_clean = 0;
+	while (n < num_pages) {
+		memset(ubufs, 0, sizeof(ubufs));
+		batch.bufs = (u_int64_t)(uintptr_t)ubufs;
+		batch.count = num_pages - n;
+		if (batch.count > IGB_BUF_BATCH_MAX)
+			batch.count = IGB_BUF_BATCH_MAX;
+		batch.done = 0;
 
-	/* Set number of descriptors available */
-	txr->tx_avail = adapter->num_tx_desc;
-}
+		error = igb_lock(dev);
+		if (error)
+			goto err;
+		if (ioctl(adapter->ldev, IGB_IOCTL_MAPBUF_BATCH, &batch) < 0)
+			error = -errno;
+		if (igb_unlock(dev) != 0 && error == 0)
+			error = -errno;
+
+		/* older modules reject unknown ioctls with EINVAL */
+		if (error == -EINVAL && n == 0) {
+			for (; n < num_pages; n++) {
+				error = igb_dma_malloc_page(dev, &pages[n]);
+				if (error)
+					goto err;
+			}
+			return 0;
+		}
+		if (error)
+			goto err;
 
-/*  Initialize all transmit rings. */
-static void igb_setup_transmit_structures(struct adapter *adapter)
-{
-	struct tx_ring *txr = adapter->tx_rings;
-	int i;
+		for (i = 0; i < batch.done; i++, n++) {
+			pages[n].dma_paddr = ubufs[i].physaddr;
+			pages[n].mmap_size = ubufs[i].mmap_size;
+			pages[n].dma_vaddr = mmap(NULL, ubufs[i].mmap_size,
+						  PROT_READ | PROT_WRITE,
+						  MAP_SHARED, adapter->ldev,
+						  ubufs[i].pa);
+			if (pages[n].dma_vaddr == MAP_FAILED) {
+				error = -ENOMEM;
+				break;
+			}
+		}
+		if (error) {
+			/* unmap the rest of this batch, then the rest */
+			for (; i < batch.done; i++) {
+				ubufs[0].physaddr = ubufs[i].physaddr;
+				if (igb_lock(dev) == 0) {
+					ioctl(adapter->ldev,
+					      IGB_IOCTL_UNMAPBUF, &ubufs[0]);
+					igb_unlock(dev);
+				}
+			}
+			goto err;
+		}
+	}
 
-	for (i = 0; i < adapter->num_queues; i++, txr++)
-		igb_setup_transmit_ring(txr);
+	return 0;
+
+err:
+	igb_dma_free_pages(dev, pages, n);
+	return error;
 }
 
-/*Enable transmit unit. */
-static void igb_initialize_transmit_units(struct adapter *adapter)
+/*
+ * Release num_pages pages from igb_dma_malloc_pages() or
+ * igb_dma_malloc_page().
+ */
+void igb_dma_free_pages(device_t *dev, struct igb_dma_alloc *pages,
+			unsigned int num_pages)
 {
-	struct tx_ring *txr = adapter->tx_rings;
-	struct e1000_hw *hw = &adapter->hw;
-	u32 txdctl;
-	int i;
-
-	txdctl = 0;
+	struct igb_buf_cmd ubufs[IGB_BUF_BATCH_MAX];
+	struct igb_buf_batch_cmd batch;
+	struct adapter *adapter;
+	unsigned int i, n = 0;
 
-	/* Setup the Tx Descriptor Rings */
-	for (i = 0; i < adapter->num_queues; i++, txr++) {
-		txdctl = 0;
-		E1000_WRITE_REG(hw, E1000_TXDCTL(i), txdctl);
+	if (dev == NULL || pages == NULL)
+		return;
 
-		/* Setup the HW Tx Head and Tail descriptor pointers */
-		E1000_WRITE_REG(hw, E1000_TDT(i), 0);
-		E1000_WRITE_REG(hw, E1000_TDH(i), 0);
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
+		return;
 
-		txr->queue_status = IGB_QUEUE_IDLE;
+	while (n < num_pages) {
+		memset(ubufs, 0, sizeof(ubufs));
+		batch.bufs = (u_int64_t)(uintptr_t)ubufs;
+		batch.count = num_pages - n;
+		if (batch.count > IGB_BUF_BATCH_MAX)
+			batch.count = IGB_BUF_BATCH_MAX;
+		batch.done = 0;
+
+		for (i = 0; i < batch.count; i++) {
+			munmap(pages[n + i].dma_vaddr, pages[n + i].mmap_size);
+			ubufs[i].physaddr = pages[n + i].dma_paddr;
+		}
 
-		txdctl |= IGB_TX_PTHRESH;
-		txdctl |= IGB_TX_HTHRESH << 8;
-		txdctl |= IGB_TX_WTHRESH << 16;
-		txdctl |= E1000_TXDCTL_PRIORITY;
-		txdctl |= E1000_TXDCTL_QUEUE_ENABLE;
-		E1000_WRITE_REG(hw, E1000_TXDCTL(i), txdctl);
+		if (igb_lock(dev) != 0)
+			return;
+		ioctl(adapter->ldev, IGB_IOCTL_UNMAPBUF_BATCH, &batch);
+		/*
+		 * the batch stops at an unknown address, and older modules
+		 * reject it outright: release what is left one at a time
+		 */
+		for (i = batch.done; i < batch.count; i++)
+			ioctl(adapter->ldev, IGB_IOCTL_UNMAPBUF, &ubufs[i]);
+		if (igb_unlock(dev) != 0)
+			return;
+
+		for (i = 0; i < batch.count; i++, n++) {
+			pages[n].dma_paddr = 0;
+			pages[n].dma_vaddr = NULL;
+			pages[n].mmap_size = 0;
+		}
 	}
-
 }
 
-/* Free all transmit rings. */
-static void igb_free_transmit_structures(struct adapter *adapter)
+/*
+ * Pin len bytes of application memory at addr (an ALSA or JACK period
+ * buffer, say) and map it for DMA, so packets can point straight at it
+ * instead of being copied into igb_dma_malloc_page() memory. The memory
+ * must stay mapped until igb_unpin_buffer(), and counts against
+ * RLIMIT_MEMLOCK meanwhile (-ENOMEM past it). Up to IGB_PIN_MAX_PAGES
+ * pages per call. Returns -ENOTTY if the kernel module predates pinning,
+ * -EOPNOTSUPP where the DMA mapping would bounce through swiotlb or need
+ * cache maintenance (and on kernels older than 5.8, which cannot tell).
+ */
+int igb_pin_buffer(device_t *dev, struct igb_pinned *pin, void *addr,
+		   size_t len, int flags)
 {
-	int i;
-	struct igb_buf_cmd ubuf = {0};
+	struct igb_pin_cmd upin = {0};
+	struct adapter *adapter;
+	long page_size;
+	int error;
 
-	for (i = 0; i < adapter->num_queues; i++) {
-		if (adapter->tx_rings[i].tx_base)
-			munmap(adapter->tx_rings[i].tx_base,
-			       adapter->tx_rings[i].txdma.mmap_size);
-		ubuf.queue = i;
-		ioctl(adapter->ldev, IGB_IOCTL_UNMAPRING, &ubuf);
-		free(adapter->tx_rings[i].tx_buffers);
-	}
+	if (dev == NULL || pin == NULL || addr == NULL || len == 0)
+		return -EINVAL;
 
-	free(adapter->tx_rings);
-	adapter->tx_rings = NULL;
-}
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
+		return -ENXIO;
 
-/* Context Descriptor setup for VLAN or CSUM */
-static void igb_tx_ctx_setup(struct tx_ring *txr, struct igb_packet *packet)
-{
-	struct adapter *adapter = txr->adapter;
-	struct e1000_adv_tx_context_desc *TXD;
-	struct igb_tx_buffer *tx_buffer;
-	u32 type_tucmd_mlhl;
-	int ctxd;
-	u_int64_t remapped_time;
+	if (flags & ~IGB_PIN_WRITE)
+		return -EINVAL;
 
-	ctxd = txr->next_avail_desc;
-	tx_buffer = &txr->tx_buffers[ctxd];
-	TXD = (struct e1000_adv_tx_context_desc *) &txr->tx_base[ctxd];
+	if (!adapter->pin_ioctl)
+		return -ENOTTY;
 
-	type_tucmd_mlhl = E1000_ADVTXD_DCMD_DEXT | E1000_ADVTXD_DTYP_CTXT;
+	page_size = sysconf(_SC_PAGESIZE);
+	if (page_size <= 0)
+		return -EINVAL;
 
-	/* Now copy bits into descriptor */
-	TXD->vlan_macip_lens = 0;
-	TXD->type_tucmd_mlhl = htole32(type_tucmd_mlhl);
-	TXD->mss_l4len_idx = 0;
+	memset(pin, 0, sizeof(*pin));
+	pin->page_size = page_size;
+	pin->npages = ((uintptr_t)addr % page_size + len + page_size - 1) /
+		      page_size;
+	if (pin->npages > IGB_PIN_MAX_PAGES)
+		return -EINVAL;
 
-	/* remap the 64-bit nsec time to the value represented in the desc */
-	remapped_time = packet->attime - ((packet->attime / 1000000000) *
-					  1000000000);
+	pin->busaddr = calloc(pin->npages, sizeof(u_int64_t));
+	if (pin->busaddr == NULL)
+		return -ENOMEM;
 
-	remapped_time /= 32; /* scale to 32 nsec increments */
+	upin.addr = (u_int64_t)(uintptr_t)addr;
+	upin.len = len;
+	upin.bufs = (u_int64_t)(uintptr_t)pin->busaddr;
+	upin.npages = pin->npages;
+	upin.flags = (flags & IGB_PIN_WRITE) ? IGB_PIN_CMD_WRITE : 0;
 
-	TXD->seqnum_seed = remapped_time;
+	error = igb_lock(dev);
+	if (error)
+		goto err;
 
-	tx_buffer->packet = NULL;
-	tx_buffer->next_eop = -1;
+	if (ioctl(adapter->ldev, IGB_IOCTL_PIN, &upin) < 0)
+		error = -errno;
 
+	if (igb_unlock(dev) != 0 && error == 0)
+		error = -errno;
 
-	/* We've consumed the first desc, adjust counters */
-	if (++ctxd == adapter->num_tx_desc)
-		ctxd = 0;
-	txr->next_avail_desc = ctxd;
-	--txr->tx_avail;
-}
+	if (error != 0)
+		goto err;
 
+	pin->addr = addr;
+	pin->len = len;
+	pin->handle = upin.handle;
 
-/*********************************************************************
- *
- *  This routine maps a single buffer to an Advanced TX descriptor.
- *  returns ENOSPC if we run low on tx descriptors and the app needs to
- *  cleanup descriptors.
- *
- *  this is a simplified routine which doesn't do LSO, checksum offloads,
- *  multiple fragments, etc. The provided buffers are assumed to have
- *  been previously mapped with the provided dma_malloc_page routines.
- *
- **********************************************************************/
-int igb_xmit(device_t *dev, unsigned int queue_index, struct igb_packet *packet)
-{
-	struct adapter *adapter;
-	struct tx_ring *txr;
-	struct igb_tx_buffer *tx_buffer;
-	union e1000_adv_tx_desc *txd = NULL;
-	u32 cmd_type_len, olinfo_status = 0;
-	int i, first, last = 0;
-	int error = 0;
-
-	if (dev == NULL)
-		return -EINVAL;
-
-	adapter = (struct adapter *)dev->private_data;
-	if (adapter == NULL)
-		return -ENXIO;
-
-	txr = &adapter->tx_rings[queue_index];
-	if (!txr)
-		return -EINVAL;
-
-	if (queue_index > adapter->num_queues)
-		return -EINVAL;
-
-	if (packet == NULL)
-		return -EINVAL;
-
-	if (igb_lock(dev) != 0)
-		return errno;
-
-	packet->next = NULL; /* used for cleanup */
-
-	/* Set basic descriptor constants */
-	cmd_type_len = E1000_ADVTXD_DTYP_DATA;
-	cmd_type_len |= E1000_ADVTXD_DCMD_IFCS | E1000_ADVTXD_DCMD_DEXT;
-
-	/* cmd_type_len |= E1000_ADVTXD_DCMD_VLE; to enable VLAN insertion */
-
-	/*
-	 * Map the packet for DMA
-	 *
-	 * Capture the first descriptor index,
-	 * this descriptor will have the index
-	 * of the EOP which is the only one that
-	 * now gets a DONE bit writeback.
-	 */
-	first = txr->next_avail_desc;
-	tx_buffer = &txr->tx_buffers[first];
-
-	/*
-	 * Make sure we don't overrun the ring,
-	 * we need nsegs descriptors and one for
-	 * the context descriptor used for the
-	 * offloads.
-	 */
-	if (txr->tx_avail <= 2) {
-		error = ENOSPC;
-		goto unlock;
-	}
-
-	/*
-	 * Set up the context descriptor to specify
-	 * launchtimes for the packet.
-	 */
-	igb_tx_ctx_setup(txr, packet);
-
-	/*
-	 * for performance monitoring, report the DMA time of the tx desc wb
-	 */
-	olinfo_status |= E1000_TXD_DMA_TXDWB;
-
-	/* set payload length */
-	olinfo_status |= packet->len << E1000_ADVTXD_PAYLEN_SHIFT;
-
-	/* Set up our transmit descriptors */
-	i = txr->next_avail_desc;
-
-	/* we assume every packet is contiguous */
-
-	tx_buffer = &txr->tx_buffers[i];
-	txd = (union e1000_adv_tx_desc *)&txr->tx_base[i];
-
-	txd->read.buffer_addr = htole64(packet->map.paddr + packet->offset);
-	txd->read.cmd_type_len = htole32(cmd_type_len | packet->len);
-	txd->read.olinfo_status = htole32(olinfo_status);
-	last = i;
-	if (++i == adapter->num_tx_desc)
-		i = 0;
-	tx_buffer->packet = NULL;
-	tx_buffer->next_eop = -1;
-
-	txr->next_avail_desc = i;
-	txr->tx_avail--;
-	tx_buffer->packet = packet;
-
-	/*
-	 * Last Descriptor of Packet
-	 * needs End Of Packet (EOP)
-	 * and Report Status (RS)
-	 */
-	txd->read.cmd_type_len |=
-	    htole32(E1000_ADVTXD_DCMD_EOP | E1000_ADVTXD_DCMD_RS);
-
-	/*
-	 * Keep track in the first buffer which
-	 * descriptor will be written back
-	 */
-	tx_buffer = &txr->tx_buffers[first];
-	tx_buffer->next_eop = last;
-
-	/*
-	 * Advance the Transmit Descriptor Tail (TDT), this tells the E1000
-	 * that this frame is available to transmit.
-	 */
-
-	E1000_WRITE_REG(&adapter->hw, E1000_TDT(txr->me), i);
-	++txr->tx_packets;
-
-unlock:
-	if (igb_unlock(dev) != 0)
-		return errno;
+	return 0;
 
+err:
+	free(pin->busaddr);
+	pin->busaddr = NULL;
+	pin->npages = 0;
 	return error;
 }
 
-void igb_trigger(device_t *dev, u_int32_t data)
+void igb_unpin_buffer(device_t *dev, struct igb_pinned *pin)
 {
+	struct igb_pin_cmd upin = {0};
 	struct adapter *adapter;
 
-	if (dev == NULL)
+	if (dev == NULL || pin == NULL || pin->busaddr == NULL)
 		return;
 
 	adapter = (struct adapter *)dev->private_data;
 	if (adapter == NULL)
 		return;
 
+	upin.handle = pin->handle;
+
 	if (igb_lock(dev) != 0)
 		return;
 
-	E1000_WRITE_REG(&(adapter->hw), E1000_WUS, data);
+	ioctl(adapter->ldev, IGB_IOCTL_UNPIN, &upin);
 	if (igb_unlock(dev) != 0)
 		return;
+
+	free(pin->busaddr);
+	memset(pin, 0, sizeof(*pin));
 }
 
-void igb_writereg(device_t *dev, u_int32_t reg, u_int32_t data)
+/*
+ * Describe len bytes at addr, inside a pinned range, as a chain of
+ * igb_packet segments linked through frag: one segment per run of pages
+ * contiguous on the bus, so mostly one, or two where the data crosses a
+ * page boundary without an IOMMU. Only map, offset, vaddr, len, frag and
+ * IGB_PACKET_FRAG are set; the caller adds the flags and launch time of
+ * the first segment, or prepends a header packet from DMA memory with
+ * IGB_PACKET_FRAG and frag pointing at frags[0]. Returns the number of
+ * segments used, or -ENOSPC if num_frags is too few.
+ */
+int igb_pinned_frags(const struct igb_pinned *pin, const void *addr,
+		     unsigned int len, struct igb_packet *frags,
+		     unsigned int num_frags)
 {
-	struct adapter *adapter;
+	uintptr_t base, off, end;
+	unsigned int page, n = 0;
+	u_int64_t bus;
 
-	if (dev == NULL)
-		return;
+	if (pin == NULL || pin->busaddr == NULL || frags == NULL || len == 0)
+		return -EINVAL;
 
-	adapter = (struct adapter *)dev->private_data;
-	if (adapter == NULL)
-		return;
+	if ((const char *)addr < (const char *)pin->addr ||
+	    (const char *)addr + len > (const char *)pin->addr + pin->len)
+		return -EINVAL;
 
-	E1000_WRITE_REG(&(adapter->hw), reg, data);
+	base = (uintptr_t)pin->addr & ~((uintptr_t)pin->page_size - 1);
+	off = (uintptr_t)addr - base;
+	end = off + len;
+
+	while (off < end) {
+		page = off / pin->page_size;
+		bus = pin->busaddr[page] + off % pin->page_size;
+
+		if (n > 0 && frags[n - 1].map.paddr + frags[n - 1].len == bus) {
+			/* continues on the bus, grow the last segment */
+			n--;
+		} else {
+			if (n == num_frags)
+				return -ENOSPC;
+			memset(&frags[n], 0, sizeof(frags[n]));
+			frags[n].map.paddr = bus;
+			frags[n].vaddr = (void *)(base + off);
+			if (n > 0) {
+				frags[n - 1].frag = &frags[n];
+				frags[n - 1].flags |= IGB_PACKET_FRAG;
+			}
+		}
+
+		/* up to the end of this page or of the data */
+		if ((page + 1) * (uintptr_t)pin->page_size < end)
+			frags[n].len += (page + 1) * pin->page_size - off;
+		else
+			frags[n].len += end - off;
+		off += (page + 1) * pin->page_size - off;
+		n++;
+	}
+
+	return n;
 }
 
-void igb_readreg(device_t *dev, u_int32_t reg, u_int32_t *data)
+/*
+ * Report the NUMA node of the NIC, -1 if the kernel module does not know
+ * it (no NUMA, or a module that predates node placement).
+ */
+int igb_get_numa_node(device_t *dev, int *dev_node)
 {
 	struct adapter *adapter;
 
-	if (dev == NULL)
-		return;
+	if (dev == NULL || dev_node == NULL)
+		return -EINVAL;
 
 	adapter = (struct adapter *)dev->private_data;
 	if (adapter == NULL)
-		return;
+		return -ENXIO;
 
-	if (data == NULL)
-		return;
+	*dev_node = adapter->dev_node;
 
-	*data = E1000_READ_REG(&(adapter->hw), reg);
+	return 0;
 }
 
-int igb_lock(device_t *dev)
+/*
+ * Place DMA buffers and packet metadata allocated from now on, by this
+ * process, on NUMA node instead of the NIC's. IGB_NUMA_DEVICE goes back
+ * to the NIC's node. Worth it when the threads touching the buffers run
+ * on a different node than the NIC. Returns -ENOTTY if the kernel
+ * module predates node placement.
+ */
+int igb_set_numa_node(device_t *dev, int node)
 {
+	struct igb_node_cmd unode;
 	struct adapter *adapter;
-	int error = -1;
+	int error;
 
-	if (dev == NULL)
-		return -ENODEV;
+	if (dev == NULL || (node < 0 && node != IGB_NUMA_DEVICE))
+		return -EINVAL;
 
 	adapter = (struct adapter *)dev->private_data;
 	if (adapter == NULL)
 		return -ENXIO;
 
-	if (adapter->active != 1)	// detach in progress
-		return -ENXIO;
+	if (!adapter->numa_ioctl)
+		return -ENOTTY;
 
-	if (!adapter->memlock)
-		return -ENXIO;
+	unode.node = node == IGB_NUMA_DEVICE ? IGB_NODE_DEVICE : node;
+	unode.dev_node = -1;
 
-	error = pthread_mutex_lock(adapter->memlock);
-	switch (error) {
-		case 0:
-			break;
-		case EOWNERDEAD:
-			// some process terminated without unlocking the mutex
-			if (pthread_mutex_consistent(adapter->memlock) != 0)
-				return -errno;
-			break;
-		default:
-			return -errno;
-			break;
-	}
+	error = igb_lock(dev);
+	if (error)
+		return error;
 
-	if (adapter->active != 1) {
-		(void) pthread_mutex_unlock(adapter->memlock);
-		return -ENXIO;
-	}
+	if (ioctl(adapter->ldev, IGB_IOCTL_NUMA_NODE, &unode) < 0)
+		error = -errno;
+
+	if (igb_unlock(dev) != 0 && error == 0)
+		error = -errno;
+
+	if (error != 0)
+		return error;
+
+	adapter->dev_node = unode.dev_node;
+	adapter->numa_node = node == IGB_NUMA_DEVICE ? unode.dev_node : node;
 
 	return 0;
 }
 
-int igb_unlock(device_t *dev)
+#define IGB_MPOL_PREFERRED	1
+#define IGB_MAX_NUMNODES	1024
+
+/*
+ * Zeroed, page aligned memory for packet metadata, on the node of the
+ * buffers it describes when the kernel allows. Freed with igb_numa_free().
+ */
+static void *igb_numa_zalloc(struct adapter *adapter, size_t size)
 {
-	struct adapter *adapter;
+	void *p;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+#ifdef __NR_mbind
+	if (adapter->numa_node >= 0 &&
+	    adapter->numa_node < IGB_MAX_NUMNODES) {
+		unsigned long mask[IGB_MAX_NUMNODES / (8 * sizeof(long))];
+		unsigned int bits = 8 * sizeof(long);
+
+		memset(mask, 0, sizeof(mask));
+		mask[adapter->numa_node / bits] |=
+			1UL << (adapter->numa_node % bits);
+
+		/* best effort: failing that, pages go where first touched */
+		(void) syscall(__NR_mbind, p, size, IGB_MPOL_PREFERRED, mask,
+			       IGB_MAX_NUMNODES + 1, 0);
+	}
+#endif
 
-	if (dev == NULL)
-		return -ENODEV;
+	return p;
+}
 
-	adapter = (struct adapter *)dev->private_data;
-	if (adapter == NULL)
-		return -ENXIO;
+static void igb_numa_free(void *p, size_t size)
+{
+	if (p != NULL)
+		munmap(p, size);
+}
 
-	if (!adapter->memlock)
-		return -ENXIO;
+/*
+ * Buffer memory for size bytes or as much of it as one region holds:
+ * a region, or a single page with kernel modules that predate regions.
+ */
+static int igb_dma_malloc_buffers(device_t *dev, struct igb_dma_alloc *dma,
+				  unsigned int size)
+{
+	int error;
 
-	return pthread_mutex_unlock(adapter->memlock);
+	if (size > IGB_DMA_REGION_MAX)
+		size = IGB_DMA_REGION_MAX;
+
+	error = igb_dma_malloc_region(dev, dma, size, 0);
+	if (error == -ENOTTY)
+		error = igb_dma_malloc_page(dev, dma);
+
+	return error;
 }
 
-/**********************************************************************
+/*********************************************************************
  *
- *  Examine each tx_buffer in the used queue. If the hardware is done
- *  processing the packet then return the linked list of associated resources.
+ *  Packet arena
+ *
+ *  An arena holds num_bufs DMA buffers of one size, carved from as few
+ *  regions as possible, with their struct igb_packet in a single cache
+ *  aligned array, ready for igb_xmit() or igb_refresh_buffers(). Free
+ *  packets sit on a lock-free stack linked by array index; the head
+ *  carries a tag bumped by every update so a stale compare-and-swap
+ *  always fails (no ABA), and since the array is never freed under the
+ *  arena a racing reader only ever sees a stale index, never freed
+ *  memory. Any thread may get and put packets without locking.
  *
  **********************************************************************/
-void igb_clean(device_t *dev, struct igb_packet **cleaned_packets)
-{
-	struct e1000_tx_desc *tx_desc, *eop_desc;
-	struct igb_packet *last_reclaimed;
-	struct igb_tx_buffer *tx_buffer;
-	struct adapter *adapter;
-	struct tx_ring *txr;
-	int first, last, done, processed, i;
-
-	if (dev == NULL)
-		return;
+#define IGB_ARENA_HEAD(tag, idx)	((u_int64_t)(tag) << 32 | (idx))
+#define IGB_ARENA_TAG(head)		((u_int32_t)((head) >> 32))
+#define IGB_ARENA_IDX(head)		((u_int32_t)(head))
 
-	adapter = (struct adapter *)dev->private_data;
-	if (adapter == NULL)
-		return;
+int igb_arena_init(device_t *dev, struct igb_arena **parena,
+		   unsigned int buf_size, unsigned int num_bufs)
+{
+	struct igb_dma_alloc *region;
+	struct igb_packet *packet;
+	struct igb_arena *arena;
+	unsigned int i = 0, off, per_region;
+	u_int64_t size;
+	int error;
 
-	if (cleaned_packets == NULL)
-		return;
+	if (dev == NULL || parena == NULL)
+		return -EINVAL;
 
-	*cleaned_packets = NULL; /* nothing reclaimed yet */
+	if (dev->private_data == NULL)
+		return -ENXIO;
 
-	if (igb_lock(dev) != 0)
-		return;
+	/* buffers start cache line aligned, none straddles a region */
+	buf_size = (buf_size + IGB_CACHELINE_SIZE - 1) &
+		   ~(IGB_CACHELINE_SIZE - 1);
+	if (buf_size == 0 || buf_size > IGB_DMA_REGION_MAX || num_bufs == 0)
+		return -EINVAL;
 
-	for (i = 0; i < adapter->num_queues; i++) {
-		txr = &adapter->tx_rings[i];
+	if (posix_memalign((void **)&arena, IGB_CACHELINE_SIZE,
+			   sizeof(*arena)))
+		return -ENOMEM;
+	memset(arena, 0, sizeof(*arena));
 
-		if (txr->tx_avail == adapter->num_tx_desc) {
-			txr->queue_status = IGB_QUEUE_IDLE;
-			continue;
-		}
+	arena->dev = dev;
+	arena->num = num_bufs;
+	arena->buf_size = buf_size;
 
-		processed = 0;
-		first = txr->next_to_clean;
-		tx_desc = &txr->tx_base[first];
-		tx_buffer = &txr->tx_buffers[first];
-		last = tx_buffer->next_eop;
-		eop_desc = &txr->tx_base[last];
+	arena->packets = igb_numa_zalloc(dev->private_data,
+					 num_bufs * sizeof(struct igb_packet));
+	if (arena->packets == NULL) {
+		error = -ENOMEM;
+		goto err;
+	}
 
-		/*
-		 * What this does is get the index of the
-		 * first descriptor AFTER the EOP of the
-		 * first packet, that way we can do the
-		 * simple comparison on the inner while loop.
-		 */
-		if (++last == adapter->num_tx_desc)
-			last = 0;
-		done = last;
+	arena->next = calloc(num_bufs, sizeof(u_int32_t));
+	if (arena->next == NULL) {
+		error = -ENOMEM;
+		goto err;
+	}
 
-		while (eop_desc->upper.fields.status & E1000_TXD_STAT_DD) {
-			if (tx_buffer->packet)
-				last_reclaimed = tx_buffer->packet;
-
-			/* We clean the range of the packet */
-			while (first != done) {
-				if (tx_buffer->packet) {
-					tx_buffer->packet->dmatime =
-						(0xffffffff) &
-						 tx_desc->buffer_addr;
-					/* tx_buffer->packet->dmatime +=
-					 *	(tx_desc->buffer_addr >> 32) *
-					 *	 1000000000;
-					 */
-					txr->bytes += tx_buffer->packet->len;
-					if (*cleaned_packets == NULL) {
-						*cleaned_packets =
-							tx_buffer->packet;
-					} else {
-						last_reclaimed->next =
-							tx_buffer->packet;
-					}
-					last_reclaimed = tx_buffer->packet;
+	arena->vaddr = calloc(num_bufs, sizeof(void *));
+	if (arena->vaddr == NULL) {
+		error = -ENOMEM;
+		goto err;
+	}
 
-					tx_buffer->packet = NULL;
-				}
-				tx_buffer->next_eop = -1;
-				tx_desc->upper.data = 0;
-				tx_desc->lower.data = 0;
-				tx_desc->buffer_addr = 0;
-				++txr->tx_avail;
-				++processed;
-
-				if (++first == adapter->num_tx_desc)
-					first = 0;
-
-				tx_buffer = &txr->tx_buffers[first];
-				tx_desc = &txr->tx_base[first];
+	while (i < num_bufs) {
+		if (arena->nregions % 16 == 0) {
+			region = realloc(arena->regions,
+					 (arena->nregions + 16) *
+					 sizeof(struct igb_dma_alloc));
+			if (region == NULL) {
+				error = -ENOMEM;
+				goto err;
 			}
-			++txr->packets;
-			/* See if we can continue to the next packet */
-			last = tx_buffer->next_eop;
-			if (last != -1) {
-				eop_desc = &txr->tx_base[last];
-				/* Get new done point */
-				if (++last == adapter->num_tx_desc)
-					last = 0;
-				done = last;
-			} else
-				break;
+			arena->regions = region;
 		}
 
-		txr->next_to_clean = first;
+		region = &arena->regions[arena->nregions];
+		size = (u_int64_t)(num_bufs - i) * buf_size;
+		if (size > IGB_DMA_REGION_MAX)
+			size = IGB_DMA_REGION_MAX;
+		error = igb_dma_malloc_buffers(dev, region, (unsigned int)size);
+		if (error != 0)
+			goto err;
+		arena->nregions++;
 
-		if (txr->tx_avail >= IGB_QUEUE_THRESHOLD)
-			txr->queue_status &= ~IGB_QUEUE_DEPLETED;
+		per_region = region->mmap_size / buf_size;
+		if (per_region == 0) {
+			error = -EINVAL;
+			goto err;
+		}
+
+		for (off = 0; off < per_region && i < num_bufs; off++, i++) {
+			packet = &arena->packets[i];
+			packet->map.paddr = region->dma_paddr;
+			packet->map.mmap_size = region->mmap_size;
+			packet->offset = off * buf_size;
+			packet->vaddr = (u8 *)region->dma_vaddr +
+					packet->offset;
+			arena->vaddr[i] = packet->vaddr;
+		}
 	}
-	igb_unlock(dev);
+
+	/* index + 1 on the stack, 0 ends it */
+	for (i = 0; i < num_bufs; i++)
+		arena->next[i] = i + 1 < num_bufs ? i + 2 : 0;
+	arena->head = IGB_ARENA_HEAD(0, 1);
+
+	*parena = arena;
+
+	return 0;
+
+err:
+	igb_arena_free(arena);
+	return error;
+}
+
+/*
+ * Release the arena and its DMA regions. Every packet must be back, or
+ * at least no longer in use by the NIC or any thread.
+ */
+void igb_arena_free(struct igb_arena *arena)
+{
+	unsigned int i;
+
+	if (arena == NULL)
+		return;
+
+	for (i = 0; i < arena->nregions; i++)
+		igb_dma_free_page(arena->dev, &arena->regions[i]);
+
+	free(arena->regions);
+	free(arena->vaddr);
+	free(arena->next);
+	igb_numa_free(arena->packets, arena->num * sizeof(struct igb_packet));
+	free(arena);
+}
+
+/*
+ * Take up to num_pkts packets, stored in packets[] and also linked
+ * through next in the same order, so the list can go straight to
+ * igb_refresh_buffers(). Returns the number taken, 0 when the arena is
+ * empty.
+ */
+int igb_arena_get_burst(struct igb_arena *arena, struct igb_packet **packets,
+			unsigned int num_pkts)
+{
+	u_int64_t head, new_head;
+	u_int32_t idx;
+	unsigned int n;
+
+	if (arena == NULL || packets == NULL)
+		return -EINVAL;
+
+	head = __atomic_load_n(&arena->head, __ATOMIC_ACQUIRE);
+	do {
+		/*
+		 * Walk the stack from a snapshot of the head; if anything
+		 * changed meanwhile, the tag makes the swap below fail.
+		 */
+		idx = IGB_ARENA_IDX(head);
+		for (n = 0; n < num_pkts && idx != 0; n++) {
+			packets[n] = &arena->packets[idx - 1];
+			idx = __atomic_load_n(&arena->next[idx - 1],
+					      __ATOMIC_RELAXED);
+		}
+		new_head = IGB_ARENA_HEAD(IGB_ARENA_TAG(head) + 1, idx);
+	} while (n != 0 &&
+		 !__atomic_compare_exchange_n(&arena->head, &head, new_head,
+					      TRUE, __ATOMIC_ACQUIRE,
+					      __ATOMIC_ACQUIRE));
+
+	for (idx = 0; idx < n; idx++) {
+		packets[idx]->next = idx + 1 < n ? packets[idx + 1] : NULL;
+		packets[idx]->frag = NULL;
+		packets[idx]->flags = 0;
+		packets[idx]->len = 0;
+	}
+
+	return n;
+}
+
+struct igb_packet *igb_arena_get(struct igb_arena *arena)
+{
+	struct igb_packet *packet;
+
+	if (igb_arena_get_burst(arena, &packet, 1) != 1)
+		return NULL;
+
+	return packet;
+}
+
+/*
+ * Give packets back, each only once, for instance the ones
+ * igb_clean_queue() returns. They are pushed with a single
+ * compare-and-swap. Packets that are not
+ * from this arena are refused with -EINVAL and nothing is put back.
+ */
+int igb_arena_put_burst(struct igb_arena *arena, struct igb_packet **packets,
+			unsigned int num_pkts)
+{
+	u_int64_t head, new_head;
+	u_int32_t first, last, idx;
+	unsigned int i;
+
+	if (arena == NULL || packets == NULL)
+		return -EINVAL;
+
+	if (num_pkts == 0)
+		return 0;
+
+	for (i = 0; i < num_pkts; i++) {
+		if (packets[i] < arena->packets ||
+		    packets[i] >= arena->packets + arena->num)
+			return -EINVAL;
+	}
+
+	/* link the batch privately, then splice it on in one go */
+	first = packets[0] - arena->packets + 1;
+	last = first;
+	for (i = 0; i < num_pkts; i++) {
+		idx = packets[i] - arena->packets + 1;
+		/* the receive path moves vaddr past a timestamp header */
+		packets[i]->vaddr = arena->vaddr[idx - 1];
+		if (i + 1 < num_pkts)
+			__atomic_store_n(&arena->next[idx - 1],
+					 packets[i + 1] - arena->packets + 1,
+					 __ATOMIC_RELAXED);
+		last = idx;
+	}
+
+	head = __atomic_load_n(&arena->head, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(&arena->next[last - 1], IGB_ARENA_IDX(head),
+				 __ATOMIC_RELAXED);
+		new_head = IGB_ARENA_HEAD(IGB_ARENA_TAG(head) + 1, first);
+	} while (!__atomic_compare_exchange_n(&arena->head, &head, new_head,
+					      TRUE, __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+
+	return 0;
+}
+
+int igb_arena_put(struct igb_arena *arena, struct igb_packet *packet)
+{
+	return igb_arena_put_burst(arena, &packet, 1);
 }
 
 /*********************************************************************
  *
- *  Allocate memory for the receive rings, and then
+ *  Allocate memory for the transmit rings, and then
  *  the descriptors associated with each, called only once at attach.
  *
  **********************************************************************/
-static int igb_allocate_rx_queues(struct adapter *adapter)
+static int igb_allocate_queues(struct adapter *adapter)
 {
-	struct igb_buf_cmd ubuf;
+	struct igb_buf_cmd ubuf = {0};
 	int dev = adapter->ldev;
 	int i, error = 0;
 
-	/* allocate the RX ring struct memory */
-	adapter->rx_rings = (struct rx_ring *) malloc(sizeof(struct rx_ring) *
-						      adapter->num_queues);
-
-	if (adapter->rx_rings == NULL) {
+	/*
+	 * allocate the TX ring struct memory, cache line aligned so the
+	 * producer and consumer halves of a ring do not share a line
+	 */
+	if (posix_memalign((void **)&adapter->tx_rings, IGB_CACHELINE_SIZE,
+			   sizeof(struct tx_ring) * adapter->num_queues) != 0) {
+		adapter->tx_rings = NULL;
 		error = -ENOMEM;
-		goto rx_fail;
+		goto tx_fail;
 	}
 
-	memset(adapter->rx_rings, 0, sizeof(struct rx_ring) *
+	memset(adapter->tx_rings, 0, sizeof(struct tx_ring) *
 					    adapter->num_queues);
 
 	for (i = 0; i < adapter->num_queues; i++) {
-
-		if (sem_init(&adapter->rx_rings[i].lock, 0, 1) != 0) {
-			error = errno;
-			goto rx_desc;
-		}
-
-		if (sem_wait(&adapter->rx_rings[i].lock) != 0) {
-			error = errno;
-			goto rx_desc;
-		}
-
 		ubuf.queue = i;
-		error = ioctl(dev, IGB_IOCTL_MAP_RX_RING, &ubuf);
+		error = ioctl(dev, IGB_IOCTL_MAPRING, &ubuf);
 		if (error < 0) {
-
 			if(error == -EINVAL)
-				goto rx_fail;
+				goto tx_fail;
 
 			error = EBUSY;
-			goto rx_desc;
+			goto tx_desc;
 		}
 
 		if (ubuf.physaddr % 128)
-			printf("warning: rx ring addr (0x%lx) is not a 128 byte-aligned\n",
-				ubuf.physaddr);
+			syslog(LOG_WARNING, "igb: tx ring addr (0x%llx) is not 128 byte-aligned\n",
+			       (unsigned long long)ubuf.physaddr);
 
-		adapter->rx_rings[i].rxdma.paddr = ubuf.physaddr;
-		adapter->rx_rings[i].rxdma.mmap_size = ubuf.mmap_size;
-		adapter->rx_rings[i].rx_base = NULL;
-		adapter->rx_rings[i].rx_base =
-			mmap(NULL, ubuf.mmap_size, PROT_READ | PROT_WRITE,
-			     MAP_SHARED, adapter->ldev, ubuf.pa);
+		adapter->tx_rings[i].txdma.paddr = ubuf.physaddr;
+		adapter->tx_rings[i].txdma.mmap_size = ubuf.mmap_size;
+		adapter->tx_rings[i].tx_base = NULL;
+		adapter->tx_rings[i].tx_base =
+			(struct e1000_tx_desc *)mmap(NULL, ubuf.mmap_size,
+						     PROT_READ | PROT_WRITE,
+						     MAP_SHARED, adapter->ldev,
+						     ubuf.pa);
 
-		if (adapter->rx_rings[i].rx_base == MAP_FAILED) {
+		if (adapter->tx_rings[i].tx_base == MAP_FAILED) {
 			error = -ENOMEM;
-			goto rx_desc;
+			goto tx_desc;
 		}
 
-		adapter->rx_rings[i].adapter = adapter;
-		adapter->rx_rings[i].me = i;
-
-		adapter->num_rx_desc = ubuf.mmap_size /
-				       sizeof(union e1000_adv_rx_desc);
+		adapter->tx_rings[i].adapter = adapter;
+		adapter->tx_rings[i].me = i;
+		adapter->tx_rings[i].lock = &adapter->locks->txq[i];
+		adapter->num_tx_desc = ubuf.mmap_size /
+				       sizeof(union e1000_adv_tx_desc);
 
 		/*
-		 * num_rx_desc must be always a multiple of 8 because the value of
-		 * RDLEN must be a multipe of 128 and each descriptor has 16 bytes.
+		 * num_tx_desc must be always a multiple of 8 because the value of
+		 * TDLEN must be a multipe of 128 and each descriptor has 16 bytes.
 		 */
-		if (adapter->num_rx_desc % 8)
-			printf("num_rx_desc(%d) is not a multiple of 8\n",
-				adapter->num_rx_desc);
+		if (adapter->num_tx_desc % 8)
+			syslog(LOG_WARNING, "igb: num_tx_desc(%d) is not a multiple of 8\n",
+			       adapter->num_tx_desc);
 
-		memset((void *)adapter->rx_rings[i].rx_base, 0, ubuf.mmap_size);
-		adapter->rx_rings[i].rx_buffers =
-			(struct igb_rx_buffer *)
-				malloc(sizeof(struct igb_rx_buffer) *
-				       adapter->num_rx_desc);
+		memset((void *)adapter->tx_rings[i].tx_base, 0, ubuf.mmap_size);
+		adapter->tx_rings[i].tx_buffers =
+			(struct igb_tx_buffer *)
+				malloc(sizeof(struct igb_tx_buffer) *
+				       adapter->num_tx_desc);
 
-		if (adapter->rx_rings[i].rx_buffers == NULL) {
+		if (adapter->tx_rings[i].tx_buffers == NULL) {
 			error = -ENOMEM;
-			goto rx_desc;
+			goto tx_desc;
 		}
 
-		memset(adapter->rx_rings[i].rx_buffers, 0,
-		       sizeof(struct igb_rx_buffer) * adapter->num_rx_desc);
-
-		if (sem_post(&adapter->rx_rings[i].lock) != 0) {
-			error = errno;
-			goto rx_desc;
-		}
+		memset(adapter->tx_rings[i].tx_buffers, 0,
+		       sizeof(struct igb_tx_buffer) * adapter->num_tx_desc);
 	}
 
 	return 0;
 
-rx_desc:
+tx_desc:
 	for (i = 0; i < adapter->num_queues; i++) {
-		if (adapter->rx_rings[i].rx_base)
-			munmap(adapter->rx_rings[i].rx_base,
-			       adapter->rx_rings[i].rxdma.mmap_size);
+		if (adapter->tx_rings[i].tx_base)
+			munmap(adapter->tx_rings[i].tx_base,
+			       adapter->tx_rings[i].txdma.mmap_size);
 		ubuf.queue = i;
-		ioctl(dev, IGB_IOCTL_UNMAP_RX_RING, &ubuf);
-
-		sem_destroy(&adapter->rx_rings[i].lock);
+		ioctl(dev, IGB_IOCTL_UNMAPRING, &ubuf);
 	};
-rx_fail:
-	free(adapter->rx_rings);
-	adapter->rx_rings = NULL;
+tx_fail:
+	free(adapter->tx_rings);
+	adapter->tx_rings = NULL;
 	return error;
 }
 
-static void igb_free_receive_ring(struct rx_ring *rxr)
-{
-	struct adapter *adapter = rxr->adapter;
-	struct igb_rx_buffer *rxbuf;
-	int i;
-
-	for (i = 0; i < adapter->num_rx_desc; i++) {
-		rxbuf = &rxr->rx_buffers[i];
-		rxbuf->next_eop = 0;
-		rxbuf->packet = NULL;
-	}
-}
-
-/* Initialize a receive ring. */
-static void igb_setup_receive_ring(struct rx_ring *rxr)
+/* Initialize a transmit ring. */
+static void igb_setup_transmit_ring(struct tx_ring *txr)
 {
-	struct adapter *adapter = rxr->adapter;
-
-	(void)sem_wait(&rxr->lock);
-
-	/* Clear the ring contents */
-	memset((void *)rxr->rx_base,  0,
-	       (sizeof(union e1000_adv_rx_desc)) * adapter->num_rx_desc);
+	struct adapter *adapter = txr->adapter;
 
-	memset(rxr->rx_buffers, 0, sizeof(struct igb_rx_buffer) *
-				   rxr->adapter->num_rx_desc);
+	/* Clear the old descriptor contents */
+	memset((void *)txr->tx_base,  0,
+	       (sizeof(union e1000_adv_tx_desc)) * adapter->num_tx_desc);
 
-	/* Free current RX buffer structures */
-	igb_free_receive_ring(rxr);
+	memset(txr->tx_buffers, 0, sizeof(struct igb_tx_buffer) *
+				   txr->adapter->num_tx_desc);
 
-	/* Setup our descriptor indices */
-	rxr->next_to_check = 0;
-	rxr->next_to_refresh = 0;
-	rxr->rx_split_packets = 0;
-	rxr->rx_bytes = 0;
+	/* Reset indices, an empty ring has them equal */
+	txr->next_avail_desc = 0;
+	txr->clean_cache = 0;
+	txr->next_to_clean = 0;
 
-	(void)sem_post(&rxr->lock);
+	/* the queue's context is unknown until the first one is written */
+	txr->ctx_launch = 1;
 }
 
-/* Initialize all receive rings. */
-static void igb_setup_receive_structures(struct adapter *adapter)
+/*  Initialize all transmit rings. */
+static void igb_setup_transmit_structures(struct adapter *adapter)
 {
-	struct rx_ring *rxr = adapter->rx_rings;
+	struct tx_ring *txr = adapter->tx_rings;
 	int i;
 
-	for (i = 0; i < adapter->num_queues; i++, rxr++)
-		igb_setup_receive_ring(rxr);
+	for (i = 0; i < adapter->num_queues; i++, txr++)
+		igb_setup_transmit_ring(txr);
 }
 
-/* Enable receive unit. */
-static void igb_initialize_receive_units(struct adapter *adapter)
+/*Enable transmit unit. */
+static void igb_initialize_transmit_units(struct adapter *adapter)
 {
-	struct rx_ring *rxr = adapter->rx_rings;
+	struct tx_ring *txr = adapter->tx_rings;
 	struct e1000_hw *hw = &adapter->hw;
-	u32 rctl, rxcsum, srrctl = 0;
+	u32 txdctl;
 	int i;
 
-	/*
-	 * Make sure receives are disabled while setting
-	 * up the descriptor ring
-	 */
-	rctl = E1000_READ_REG(hw, E1000_RCTL);
-	E1000_WRITE_REG(hw, E1000_RCTL, rctl & ~E1000_RCTL_EN);
+	txdctl = 0;
 
-	rctl &= ~E1000_RCTL_LPE;
-	srrctl |= 2048 >> E1000_SRRCTL_BSIZEPKT_SHIFT;
-	srrctl |= E1000_SRRCTL_DESCTYPE_ADV_ONEBUF;
-	rctl |= E1000_RCTL_SZ_2048;
+	/* Setup the Tx Descriptor Rings */
+	for (i = 0; i < adapter->num_queues; i++, txr++) {
+		txdctl = 0;
+		E1000_WRITE_REG(hw, E1000_TXDCTL(i), txdctl);
 
-	/* Setup the Base and Length of the Rx Descriptor Rings */
-	for (i = 0; i < adapter->num_queues; i++, rxr++) {
-		u64 bus_addr = rxr->rxdma.paddr;
-		u32 rxdctl, rxdctlpollcnt = 0;
+		/* Setup the HW Tx Head and Tail descriptor pointers */
+		E1000_WRITE_REG(hw, E1000_TDT(i), 0);
+		E1000_WRITE_REG(hw, E1000_TDH(i), 0);
 
-		/* Disable this Queue */
-		E1000_WRITE_REG(hw, E1000_RXDCTL(i), 0);
-		do {
-			rxdctl = E1000_READ_REG(hw, E1000_RXDCTL(i)) & E1000_RXDCTL_QUEUE_ENABLE;
-		} while (rxdctl && ++rxdctlpollcnt < IGB_RXDCTL_MAX_POLL);
+		/* restore head write-back if igb_set_tx_head_wb() enabled it */
+		if (txr->head_wb) {
+			u64 bus_addr = adapter->txhwb.dma_paddr +
+				       i * IGB_CACHELINE_SIZE;
 
-		E1000_WRITE_REG(hw, E1000_RDLEN(i),
-				adapter->num_rx_desc *
-					sizeof(union e1000_adv_rx_desc));
-		E1000_WRITE_REG(hw, E1000_RDBAH(i),
-				(uint32_t)(bus_addr >> 32));
-		E1000_WRITE_REG(hw, E1000_RDBAL(i),
-				(uint32_t)bus_addr);
-		E1000_WRITE_REG(hw, E1000_SRRCTL(i), srrctl);
+			*txr->head_wb = 0;
+			E1000_WRITE_REG(hw, E1000_TDWBAH(i),
+					(u32)(bus_addr >> 32));
+			E1000_WRITE_REG(hw, E1000_TDWBAL(i),
+					(u32)bus_addr | E1000_TX_HEAD_WB_ENABLE);
+		}
+
+		txr->queue_status = IGB_QUEUE_IDLE;
+
+		txdctl |= IGB_TX_PTHRESH;
+		txdctl |= IGB_TX_HTHRESH << 8;
+		txdctl |= IGB_TX_WTHRESH << 16;
+		txdctl |= E1000_TXDCTL_PRIORITY;
+		txdctl |= E1000_TXDCTL_QUEUE_ENABLE;
+		E1000_WRITE_REG(hw, E1000_TXDCTL(i), txdctl);
+	}
+}
+
+/* Free all transmit rings. */
+static void igb_free_transmit_structures(struct adapter *adapter)
+{
+	int i;
+	struct igb_buf_cmd ubuf = {0};
+
+	for (i = 0; i < adapter->num_queues; i++) {
+		if (adapter->tx_rings[i].tx_base)
+			munmap(adapter->tx_rings[i].tx_base,
+			       adapter->tx_rings[i].txdma.mmap_size);
+		ubuf.queue = i;
+		ioctl(adapter->ldev, IGB_IOCTL_UNMAPRING, &ubuf);
+		free(adapter->tx_rings[i].tx_buffers);
+	}
+
+	free(adapter->tx_rings);
+	adapter->tx_rings = NULL;
+}
+
+/*
+ * Context Descriptor setup for the launch time, VLAN tag and checksum
+ * offloads, written at index ctxd. Returns the index of the next free
+ * descriptor.
+ */
+static int igb_tx_ctx_setup(struct tx_ring *txr, struct igb_packet *packet,
+			    int ctxd)
+{
+	struct adapter *adapter = txr->adapter;
+	struct e1000_adv_tx_context_desc *TXD;
+	struct igb_tx_buffer *tx_buffer;
+	u32 vlan_macip_lens = 0, type_tucmd_mlhl;
+	u_int64_t remapped_time;
+
+	tx_buffer = &txr->tx_buffers[ctxd];
+	TXD = (struct e1000_adv_tx_context_desc *) &txr->tx_base[ctxd];
+
+	type_tucmd_mlhl = E1000_ADVTXD_DCMD_DEXT | E1000_ADVTXD_DTYP_CTXT;
+
+	/* tag inserted by the MAC when the data descriptor sets VLE */
+	if (packet->flags & IGB_PACKET_VLAN)
+		vlan_macip_lens |= (u32)packet->vlan_tci <<
+				   E1000_ADVTXD_VLAN_SHIFT;
+
+	if (packet->flags & (IGB_PACKET_IPV4_CSUM | IGB_PACKET_UDP_CSUM)) {
+		vlan_macip_lens |= (packet->l2_len ? packet->l2_len :
+				    ETH_HDR_LEN) << E1000_ADVTXD_MACLEN_SHIFT;
+		vlan_macip_lens |= packet->l3_len ? packet->l3_len :
+				   IGB_IPV4_HDR_LEN;
+		type_tucmd_mlhl |= E1000_ADVTXD_TUCMD_IPV4;
+		if (packet->flags & IGB_PACKET_UDP_CSUM)
+			type_tucmd_mlhl |= E1000_ADVTXD_TUCMD_L4T_UDP;
+	}
+
+	/* Now copy bits into descriptor */
+	TXD->vlan_macip_lens = htole32(vlan_macip_lens);
+	TXD->type_tucmd_mlhl = htole32(type_tucmd_mlhl);
+	TXD->mss_l4len_idx = 0;
+
+	/*
+	 * attime is only meaningful with IGB_PACKET_LAUNCHTIME; VLAN and
+	 * checksum-only packets load a zero launch time.
+	 */
+	remapped_time = 0;
+	if (packet->flags & IGB_PACKET_LAUNCHTIME) {
+		/* remap the 64-bit nsec time to the value in the desc */
+		remapped_time = packet->attime % 1000000000ULL;
+		remapped_time /= 32; /* scale to 32 nsec increments */
+	}
+
+	TXD->seqnum_seed = htole32((u32)remapped_time);
+	txr->ctx_launch = (remapped_time != 0);
+
+	tx_buffer->packet = NULL;
+	tx_buffer->next_eop = -1;
+
+
+	/* We've consumed the first desc */
+	if (++ctxd == adapter->num_tx_desc)
+		ctxd = 0;
+
+	return ctxd;
+}
+
+
+/*
+ * The next buffer of a frame. frag is only looked at with
+ * IGB_PACKET_FRAG, applications need not clear it otherwise.
+ */
+static inline struct igb_packet *igb_next_frag(struct igb_packet *packet)
+{
+	return (packet->flags & IGB_PACKET_FRAG) ? packet->frag : NULL;
+}
+
+/* Number of data descriptors of a frame, or -EINVAL if too many. */
+static inline int igb_tx_segs(struct igb_packet *packet)
+{
+	struct igb_packet *seg;
+	int segs = 0;
+
+	for (seg = packet; seg != NULL; seg = igb_next_frag(seg)) {
+		if (++segs > IGB_MAX_SCATTER)
+			return -EINVAL;
+	}
+
+	return segs;
+}
+
+/*
+ * A packet needs a context descriptor for its own launch time or
+ * offloads, and also to replace a launch time still loaded on the
+ * queue: the MAC holds every packet until the last loaded launch time,
+ * which only carries the nanoseconds within the second.
+ */
+static inline int igb_tx_ctx_needed(struct tx_ring *txr,
+				    struct igb_packet *packet)
+{
+	return (packet->flags & IGB_PACKET_CTX_FLAGS) || txr->ctx_launch;
+}
+
+/*********************************************************************
+ *
+ *  Return the number of descriptors needed to queue the packet, one
+ *  per segment on the frag chain plus the context descriptor, or
+ *  -EINVAL if the frame has more than IGB_MAX_SCATTER segments.
+ *
+ **********************************************************************/
+static inline int igb_tx_desc_needed(struct tx_ring *txr,
+				     struct igb_packet *packet)
+{
+	int needed;
+
+	needed = igb_tx_segs(packet);
+	if (needed < 0)
+		return needed;
+
+	/* a context descriptor is only spent on packets that use one */
+	if (igb_tx_ctx_needed(txr, packet))
+		needed++;
+
+	return needed;
+}
+
+/*********************************************************************
+ *
+ *  Return the number of free descriptors on the ring.
+ *
+ *  The producer only looks at the consumer's next_to_clean when its
+ *  cached copy says there is not enough room for 'needed' descriptors,
+ *  so the producer and consumer cache lines are not bounced on every
+ *  packet. One descriptor is never handed out so that a full ring can
+ *  be told apart from an empty one.
+ *
+ **********************************************************************/
+static int igb_tx_desc_avail(struct tx_ring *txr, int needed)
+{
+	int num_tx_desc = txr->adapter->num_tx_desc;
+	int used;
+
+	used = (int)txr->next_avail_desc - (int)txr->clean_cache;
+	if (used < 0)
+		used += num_tx_desc;
+
+	if (num_tx_desc - used > needed)
+		return num_tx_desc - used;
+
+	txr->clean_cache = __atomic_load_n(&txr->next_to_clean,
+					   __ATOMIC_ACQUIRE);
+
+	used = (int)txr->next_avail_desc - (int)txr->clean_cache;
+	if (used < 0)
+		used += num_tx_desc;
+
+	return num_tx_desc - used;
+}
+
+/*
+ * The queue lock is skipped on rings in single producer/single consumer
+ * mode, where next_avail_desc and next_to_clean are handed over with
+ * release/acquire ordering instead.
+ */
+static inline int igb_tx_begin(struct tx_ring *txr)
+{
+	if (txr->spsc)
+		return (txr->adapter->active == 1) ? 0 : -ENXIO;
+
+	return igb_lock_queue(txr);
+}
+
+static inline void igb_tx_end(struct tx_ring *txr)
+{
+	if (!txr->spsc)
+		igb_unlock_queue(txr);
+}
+
+/*********************************************************************
+ *
+ *  This routine maps a packet and its frag chain to Advanced TX
+ *  descriptors, starting at descriptor index i, and returns the index
+ *  following the packet. The caller must own the producer side of the ring and
+ *  must have checked that igb_tx_desc_needed() descriptors are
+ *  available. Neither next_avail_desc nor the tail register are
+ *  updated here so several packets can be published at once.
+ *
+ **********************************************************************/
+static int igb_tx_encap(struct tx_ring *txr, struct igb_packet *packet, int i)
+{
+	struct adapter *adapter = txr->adapter;
+	struct igb_tx_buffer *tx_buffer;
+	union e1000_adv_tx_desc *txd = NULL;
+	struct igb_packet *seg;
+	u32 cmd_type_len, olinfo_status = 0;
+	u32 paylen = 0;
+	int first, last = 0;
+
+	packet->next = NULL; /* used for cleanup */
+
+	/* Set basic descriptor constants */
+	cmd_type_len = E1000_ADVTXD_DTYP_DATA;
+	cmd_type_len |= E1000_ADVTXD_DCMD_IFCS | E1000_ADVTXD_DCMD_DEXT;
+
+	/* insert the 802.1Q tag loaded in the context descriptor */
+	if (packet->flags & IGB_PACKET_VLAN)
+		cmd_type_len |= E1000_ADVTXD_DCMD_VLE;
+
+	packet->latchtime = 0;
+
+	/*
+	 * Map the packet for DMA
+	 *
+	 * Capture the first descriptor index,
+	 * this descriptor will have the index
+	 * of the EOP which is the only one that
+	 * now gets a DONE bit writeback.
+	 */
+	first = i;
+
+	/*
+	 * Set up the context descriptor to specify the launch
+	 * time, VLAN tag and checksum offsets for the packet.
+	 * Packets without any of these go out with the context
+	 * last loaded on the queue as long as it holds no launch
+	 * time; VLE and the checksum options are clear on their
+	 * data descriptors, so the stale tag and offsets are not
+	 * used.
+	 */
+	if (igb_tx_ctx_needed(txr, packet))
+		i = igb_tx_ctx_setup(txr, packet, i);
+
+	if (packet->flags & IGB_PACKET_IPV4_CSUM)
+		olinfo_status |= E1000_TXD_POPTS_IXSM << 8;
+	if (packet->flags & IGB_PACKET_UDP_CSUM)
+		olinfo_status |= E1000_TXD_POPTS_TXSM << 8;
+
+	/*
+	 * for performance monitoring, report the DMA time of the tx desc wb
+	 */
+	olinfo_status |= E1000_TXD_DMA_TXDWB;
+
+	/* set payload length, the whole frame across all segments */
+	for (seg = packet; seg != NULL; seg = igb_next_frag(seg))
+		paylen += seg->len;
+	olinfo_status |= paylen << E1000_ADVTXD_PAYLEN_SHIFT;
+
+	/* Set up our transmit descriptors, one per segment */
+	for (seg = packet; seg != NULL; seg = igb_next_frag(seg)) {
+		tx_buffer = &txr->tx_buffers[i];
+		txd = (union e1000_adv_tx_desc *)&txr->tx_base[i];
+
+		txd->read.buffer_addr = htole64(seg->map.paddr + seg->offset);
+		txd->read.cmd_type_len = htole32(cmd_type_len | seg->len);
+		txd->read.olinfo_status = htole32(olinfo_status);
+		last = i;
+		if (++i == adapter->num_tx_desc)
+			i = 0;
+		tx_buffer->packet = NULL;
+		tx_buffer->next_eop = -1;
+
+		/*
+		 * only the first data descriptor carries the frame length,
+		 * TXDWB stays on all of them for the EOP write-back
+		 */
+		olinfo_status &= ~(paylen << E1000_ADVTXD_PAYLEN_SHIFT);
+	}
+
+	/*
+	 * The packet is returned from the last descriptor,
+	 * which is the one the DMA time is written back to.
+	 */
+	txr->tx_buffers[last].packet = packet;
+
+	/*
+	 * Last Descriptor of Packet
+	 * needs End Of Packet (EOP)
+	 * and Report Status (RS)
+	 */
+	txd->read.cmd_type_len |=
+	    htole32(E1000_ADVTXD_DCMD_EOP | E1000_ADVTXD_DCMD_RS);
+
+	/*
+	 * Keep track in the first buffer which
+	 * descriptor will be written back
+	 */
+	tx_buffer = &txr->tx_buffers[first];
+	tx_buffer->next_eop = last;
+
+	++txr->tx_packets;
+
+	return i;
+}
+
+/*********************************************************************
+ *
+ *  This routine maps a single buffer to an Advanced TX descriptor.
+ *  returns ENOSPC if we run low on tx descriptors and the app needs to
+ *  cleanup descriptors.
+ *
+ *  this is a simplified routine which doesn't do LSO, checksum offloads,
+ *  etc. A frame may be split over several buffers chained through
+ *  packet->frag, each but the last flagged IGB_PACKET_FRAG, with the
+ *  other flags and launch time taken from the first one. The provided buffers are assumed to have been previously mapped
+ *  with the provided dma_malloc_page routines.
+ *
+ **********************************************************************/
+int igb_xmit(device_t *dev, unsigned int queue_index, struct igb_packet *packet)
+{
+	struct adapter *adapter;
+	struct tx_ring *txr;
+	int i, needed;
+	int error = 0;
+
+	if (dev == NULL)
+		return -EINVAL;
+
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
+		return -ENXIO;
+
+	txr = &adapter->tx_rings[queue_index];
+	if (!txr)
+		return -EINVAL;
+
+	if (queue_index > adapter->num_queues)
+		return -EINVAL;
+
+	if (packet == NULL)
+		return -EINVAL;
+
+	error = igb_tx_begin(txr);
+	if (error != 0)
+		return error;
+
+	/*
+	 * Make sure we don't overrun the ring,
+	 * we need nsegs descriptors and one for
+	 * the context descriptor used for the
+	 * launch time, if any.
+	 */
+	needed = igb_tx_desc_needed(txr, packet);
+	if (needed < 0) {
+		error = needed;
+		goto unlock;
+	}
+
+	if (igb_tx_desc_avail(txr, needed) <= needed) {
+		++txr->no_desc_avail;
+		++txr->tx_enospc;
+		error = ENOSPC;
+		goto unlock;
+	}
+
+	i = igb_tx_encap(txr, packet, txr->next_avail_desc);
+
+	/* hand the descriptors over to igb_clean() */
+	__atomic_store_n(&txr->next_avail_desc, i, __ATOMIC_RELEASE);
+
+	/*
+	 * Advance the Transmit Descriptor Tail (TDT), this tells the E1000
+	 * that this frame is available to transmit.
+	 */
+
+	E1000_WRITE_REG(&adapter->hw, E1000_TDT(txr->me), i);
+
+unlock:
+	igb_tx_end(txr);
+
+	return error;
+}
+
+/*********************************************************************
+ *
+ *  Queue up to num_pkts packets on a transmit ring with a single lock
+ *  round trip and a single tail (TDT) update. Packets are accepted in
+ *  order until the ring runs out of descriptors; returns the number of
+ *  packets accepted, the caller still owns the rest.
+ *
+ **********************************************************************/
+int igb_xmit_burst(device_t *dev, unsigned int queue_index,
+		   struct igb_packet **packets, unsigned int num_pkts)
+{
+	struct adapter *adapter;
+	struct tx_ring *txr;
+	unsigned int sent;
+	int i, avail, needed;
+	int error;
+
+	if (dev == NULL)
+		return -EINVAL;
+
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
+		return -ENXIO;
+
+	if (adapter->tx_rings == NULL)
+		return -EINVAL;
+
+	if (queue_index >= adapter->num_queues)
+		return -EINVAL;
+
+	if (packets == NULL)
+		return -EINVAL;
+
+	txr = &adapter->tx_rings[queue_index];
+
+	error = igb_tx_begin(txr);
+	if (error != 0)
+		return error;
+
+	for (sent = 0, needed = 0; sent < num_pkts; sent++) {
+		if (packets[sent] == NULL)
+			break;
+		i = igb_tx_desc_needed(txr, packets[sent]);
+		if (i < 0)
+			break;
+		needed += i;
+	}
+
+	/* the first packet has too many segments to ever be queued */
+	if (sent == 0 && num_pkts != 0 && packets[0] != NULL) {
+		igb_tx_end(txr);
+		return -EINVAL;
+	}
+	num_pkts = sent;
+
+	/*
+	 * Reserve ring space once for the whole burst, always leaving
+	 * one descriptor free so the tail never catches up with the head.
+	 */
+	avail = igb_tx_desc_avail(txr, needed) - 1;
+	i = txr->next_avail_desc;
+
+	for (sent = 0; sent < num_pkts; sent++) {
+		needed = igb_tx_desc_needed(txr, packets[sent]);
+		if (needed > avail)
+			break;
+
+		avail -= needed;
+		i = igb_tx_encap(txr, packets[sent], i);
+	}
+
+	if (sent < num_pkts) {
+		++txr->no_desc_avail;
+		txr->tx_enospc += num_pkts - sent;
+	}
+
+	/* one doorbell for everything queued above */
+	if (sent) {
+		__atomic_store_n(&txr->next_avail_desc, i, __ATOMIC_RELEASE);
+		E1000_WRITE_REG(&adapter->hw, E1000_TDT(txr->me), i);
+	}
+
+	igb_tx_end(txr);
+
+	return sent;
+}
+
+/*
+ * Switch a transmit queue between the default locked mode and single
+ * producer/single consumer mode. In SPSC mode igb_xmit()/igb_xmit_burst()
+ * and igb_clean() skip the queue lock; the application guarantees that a
+ * single thread transmits on the queue and a single thread cleans it.
+ * Only change the mode while no thread is using the queue.
+ */
+int igb_set_tx_spsc(device_t *dev, unsigned int queue_index, int enable)
+{
+	struct adapter *adapter;
+	struct tx_ring *txr;
+	int error;
+
+	if (dev == NULL)
+		return -EINVAL;
+
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
+		return -ENXIO;
+
+	if (adapter->tx_rings == NULL)
+		return -EINVAL;
+
+	if (queue_index >= adapter->num_queues)
+		return -EINVAL;
+
+	txr = &adapter->tx_rings[queue_index];
+
+	error = igb_lock_queue(txr);
+	if (error != 0)
+		return error;
+
+	txr->spsc = enable ? 1 : 0;
+
+	igb_unlock_queue(txr);
+
+	return 0;
+}
+
+/*********************************************************************
+ *
+ *  Switch a transmit queue to head write-back completion. The NIC then
+ *  DMAs its head index to a host cache line instead of setting DD in
+ *  each descriptor, and the clean routines complete frames with a
+ *  single read of that line. The write-back area is one DMA page shared
+ *  by all queues, allocated on first use. Descriptors are not written
+ *  back in this mode, so cleaned packets report a dmatime of 0.
+ *
+ *  The queue must be empty; returns -EBUSY otherwise.
+ *
+ **********************************************************************/
+int igb_set_tx_head_wb(device_t *dev, unsigned int queue_index, int enable)
+{
+	struct igb_dma_alloc hwb = {0};
+	struct adapter *adapter;
+	struct e1000_hw *hw;
+	struct tx_ring *txr;
+	u64 bus_addr;
+	int error;
+
+	if (dev == NULL)
+		return -EINVAL;
+
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
+		return -ENXIO;
+
+	if (adapter->tx_rings == NULL)
+		return -EINVAL;
+
+	if (queue_index >= adapter->num_queues)
+		return -EINVAL;
+
+	txr = &adapter->tx_rings[queue_index];
+	hw = &adapter->hw;
+
+	/* MAPBUF takes the control lock itself, so allocate beforehand */
+	if (enable && adapter->txhwb.dma_vaddr == NULL) {
+		error = igb_dma_malloc_page(dev, &hwb);
+		if (error != 0)
+			return error;
+	}
+
+	error = igb_lock(dev);
+	if (error != 0)
+		goto free_page;
+
+	error = igb_lock_queue(txr);
+	if (error != 0) {
+		igb_unlock(dev);
+		goto free_page;
+	}
+
+	if (txr->next_to_clean != txr->next_avail_desc) {
+		error = -EBUSY;
+		goto unlock;
+	}
+
+	if (!enable) {
+		E1000_WRITE_REG(hw, E1000_TDWBAL(txr->me), 0);
+		E1000_WRITE_REG(hw, E1000_TDWBAH(txr->me), 0);
+		txr->head_wb = NULL;
+		goto unlock;
+	}
+
+	/* keep ours unless another thread installed a page meanwhile */
+	if (adapter->txhwb.dma_vaddr == NULL) {
+		adapter->txhwb = hwb;
+		hwb.dma_vaddr = NULL;
+	}
+
+	bus_addr = adapter->txhwb.dma_paddr + txr->me * IGB_CACHELINE_SIZE;
+	txr->head_wb = (volatile u32 *)((u8 *)adapter->txhwb.dma_vaddr +
+					txr->me * IGB_CACHELINE_SIZE);
+	*txr->head_wb = htole32(E1000_READ_REG(hw, E1000_TDH(txr->me)));
+
+	E1000_WRITE_REG(hw, E1000_TDWBAH(txr->me), (u32)(bus_addr >> 32));
+	E1000_WRITE_REG(hw, E1000_TDWBAL(txr->me),
+			(u32)bus_addr | E1000_TX_HEAD_WB_ENABLE);
+
+unlock:
+	igb_unlock_queue(txr);
+	igb_unlock(dev);
+
+free_page:
+	if (hwb.dma_vaddr != NULL)
+		igb_dma_free_page(dev, &hwb);
+
+	return error;
+}
+
+/*********************************************************************
+ *
+ *  Stream header templates
+ *
+ *  A talker formats the Ethernet/VLAN/AVTP header of a stream once
+ *  with igb_stream_template_init(). igb_stream_template_apply() then
+ *  copies it to the front of each packet buffer and patches in the
+ *  per-packet AVTP fields, so the header is never rebuilt per packet.
+ *
+ **********************************************************************/
+int igb_stream_template_init(struct igb_stream_template *tmpl,
+			     const void *hdr, unsigned int hdr_len,
+			     unsigned int avtp_offset)
+{
+	if (tmpl == NULL || hdr == NULL)
+		return -EINVAL;
+
+	if (hdr_len > IGB_STREAM_HDR_MAX)
+		return -EINVAL;
+
+	/* the AVTP stream header must be complete within the template */
+	if (hdr_len < IGB_AVTP_STREAM_HDR_LEN ||
+	    avtp_offset > hdr_len - IGB_AVTP_STREAM_HDR_LEN)
+		return -EINVAL;
+
+	memset(tmpl->hdr, 0, sizeof(tmpl->hdr));
+	memcpy(tmpl->hdr, hdr, hdr_len);
+	tmpl->hdr_len = hdr_len;
+	tmpl->avtp_offset = avtp_offset;
+
+	return 0;
+}
+
+/*
+ * Copy the template to the packet buffer. The template is 16 byte
+ * aligned and the copy is done with 16 byte vector stores, leaving any
+ * partial tail to memcpy() so the payload following the header is not
+ * touched.
+ */
+static inline void igb_stream_hdr_copy(u_int8_t *dst,
+				       const struct igb_stream_template *tmpl)
+{
+	unsigned int off = 0;
+
+#ifdef __SSE2__
+	for (; off + 16 <= tmpl->hdr_len; off += 16)
+		_mm_storeu_si128((__m128i *)(dst + off),
+				 _mm_load_si128((const __m128i *)
+						(tmpl->hdr + off)));
+#endif
+	if (off < tmpl->hdr_len)
+		memcpy(dst + off, tmpl->hdr + off, tmpl->hdr_len - off);
+}
+
+int igb_stream_template_apply(const struct igb_stream_template *tmpl,
+			      struct igb_packet *packet, u_int8_t seqnum,
+			      u_int32_t avtp_time, int tv,
+			      u_int16_t data_len)
+{
+	u_int8_t *avtp;
+	u_int32_t be32;
+	u_int16_t be16;
+
+	if (tmpl == NULL || packet == NULL || packet->vaddr == NULL)
+		return -EINVAL;
+
+	igb_stream_hdr_copy((u_int8_t *)packet->vaddr, tmpl);
+
+	avtp = (u_int8_t *)packet->vaddr + tmpl->avtp_offset;
+
+	avtp[IGB_AVTP_SEQNUM_OFFSET] = seqnum;
+
+	if (tv)
+		avtp[IGB_AVTP_TV_OFFSET] |= IGB_AVTP_TV;
+	else
+		avtp[IGB_AVTP_TV_OFFSET] &= ~IGB_AVTP_TV;
+
+	/* the header is only byte aligned in the buffer */
+	be32 = htobe32(avtp_time);
+	memcpy(avtp + IGB_AVTP_TIMESTAMP_OFFSET, &be32, sizeof(be32));
+
+	be16 = htobe16(data_len);
+	memcpy(avtp + IGB_AVTP_DATA_LEN_OFFSET, &be16, sizeof(be16));
+
+	return 0;
+}
+
+/*********************************************************************
+ *
+ *  AVTP stream demultiplexer
+ *
+ *  A listener subscribes streams with igb_demux_add() and passes each
+ *  received burst to igb_demux_run(). The stream IDs of a batch of
+ *  frames are parsed and hashed first, with the table buckets they
+ *  land in prefetched, then each is probed a bucket at a time: with
+ *  SSE2 both keys of a bucket are compared in one instruction. The
+ *  frames matched are gathered per stream and each stream's callback
+ *  runs once per batch.
+ *
+ *  Adding and removing streams must not race igb_demux_run().
+ *
+ **********************************************************************/
+static inline unsigned int igb_demux_hash(const struct igb_demux *demux,
+					  u_int64_t stream_id)
+{
+	return (unsigned int)((stream_id * 0x9E3779B97F4A7C15ull) >>
+			      demux->shift);
+}
+
+/* Index in streams[] of a stream, or -1. */
+static inline int igb_demux_lookup(const struct igb_demux *demux,
+				   u_int64_t stream_id, unsigned int b)
+{
+	const u_int64_t *keys;
+#ifdef __SSE2__
+	__m128i id = _mm_set1_epi64x((long long)stream_id);
+	__m128i k;
+	int hit;
+#endif
+
+	for (;; b = (b + 1) & (demux->nbuckets - 1)) {
+		keys = &demux->keys[b * IGB_DEMUX_BUCKET];
+#ifdef __SSE2__
+		/* no 64 bit compare in SSE2, both 32 bit halves must match */
+		k = _mm_load_si128((const __m128i *)keys);
+		hit = _mm_movemask_epi8(_mm_cmpeq_epi32(k, id));
+		if ((hit & 0x00ff) == 0x00ff)
+			return demux->slot[b * IGB_DEMUX_BUCKET];
+		if ((hit & 0xff00) == 0xff00)
+			return demux->slot[b * IGB_DEMUX_BUCKET + 1];
+#else
+		if (keys[0] == stream_id)
+			return demux->slot[b * IGB_DEMUX_BUCKET];
+		if (keys[1] == stream_id)
+			return demux->slot[b * IGB_DEMUX_BUCKET + 1];
+#endif
+		if (keys[1] == 0)
+			return -1;
+	}
+}
+
+static void igb_demux_insert(struct igb_demux *demux, u_int64_t stream_id,
+			     unsigned int index)
+{
+	unsigned int b, i;
+
+	b = igb_demux_hash(demux, stream_id);
+	for (;; b = (b + 1) & (demux->nbuckets - 1)) {
+		for (i = b * IGB_DEMUX_BUCKET;
+		     i < (b + 1) * IGB_DEMUX_BUCKET; i++) {
+			if (demux->keys[i] == 0) {
+				demux->keys[i] = stream_id;
+				demux->slot[i] = index;
+				return;
+			}
+		}
+	}
+}
+
+/*
+ * stream_id of an AVTP stream frame, or 0. With header split the frame
+ * starts in the header buffer; the NIC only moves the L2 header there
+ * for AVTP, so the stream_id is then read across both buffers.
+ */
+static inline u_int64_t igb_demux_stream_id(const struct igb_packet *packet)
+{
+	u_int8_t split[IGB_DEMUX_HDR_LEN];
+	const u_int8_t *hdr;
+	unsigned int len, off = 2 * ETH_ADDR_LEN;
+	u_int64_t be64;
+	u_int16_t type;
+
+	if (packet->hdr_len == 0) {
+		hdr = packet->vaddr;
+		len = packet->len;
+	} else if (packet->hdr_len >= IGB_DEMUX_HDR_LEN) {
+		hdr = packet->hdr_vaddr;
+		len = packet->hdr_len;
+	} else {
+		len = packet->hdr_len + packet->len;
+		if (len > IGB_DEMUX_HDR_LEN)
+			len = IGB_DEMUX_HDR_LEN;
+		memcpy(split, packet->hdr_vaddr, packet->hdr_len);
+		memcpy(split + packet->hdr_len, packet->vaddr,
+		       len - packet->hdr_len);
+		hdr = split;
+	}
+
+	if (len < IGB_DEMUX_HDR_LEN)
+		return 0;
+
+	type = (u_int16_t)(hdr[off] << 8 | hdr[off + 1]);
+	if (type == IGB_VLAN_ETHERTYPE) {
+		off += IGB_VLAN_HDR_LEN;
+		type = (u_int16_t)(hdr[off] << 8 | hdr[off + 1]);
+	}
+	off += 2;
+
+	if (type != IGB_AVTP_ETHERTYPE ||
+	    !(hdr[off + IGB_AVTP_SV_OFFSET] & IGB_AVTP_SV))
+		return 0;
+
+	memcpy(&be64, hdr + off + IGB_AVTP_STREAM_ID_OFFSET, sizeof(be64));
+
+	return be64toh(be64);
+}
+
+/*
+ * Create a demultiplexer for up to max_streams streams. The table has
+ * at least two slots per stream, which keeps probes short.
+ */
+int igb_demux_init(struct igb_demux **pdemux, unsigned int max_streams)
+{
+	struct igb_demux *demux;
+	unsigned int nbuckets = 2, bits = 1;
+
+	if (pdemux == NULL || max_streams == 0 || max_streams > 0xffff)
+		return -EINVAL;
+
+	while (nbuckets < max_streams) {
+		nbuckets <<= 1;
+		bits++;
+	}
+
+	demux = calloc(1, sizeof(*demux));
+	if (demux == NULL)
+		return -ENOMEM;
+
+	demux->nbuckets = nbuckets;
+	demux->shift = 64 - bits;
+	demux->max_streams = max_streams;
+
+	if (posix_memalign((void **)&demux->keys, IGB_CACHELINE_SIZE,
+			   nbuckets * IGB_DEMUX_BUCKET * sizeof(u_int64_t))) {
+		demux->keys = NULL;
+		igb_demux_free(demux);
+		return -ENOMEM;
+	}
+	memset(demux->keys, 0, nbuckets * IGB_DEMUX_BUCKET *
+	       sizeof(u_int64_t));
+
+	demux->slot = calloc(nbuckets * IGB_DEMUX_BUCKET, sizeof(u_int16_t));
+	demux->streams = calloc(max_streams, sizeof(struct igb_demux_stream));
+	if (demux->slot == NULL || demux->streams == NULL) {
+		igb_demux_free(demux);
+		return -ENOMEM;
+	}
+
+	*pdemux = demux;
+
+	return 0;
+}
+
+void igb_demux_free(struct igb_demux *demux)
+{
+	if (demux == NULL)
+		return;
+
+	free(demux->keys);
+	free(demux->slot);
+	free(demux->streams);
+	free(demux);
+}
+
+/* Subscribe a stream, stream_id 0 is reserved for empty table slots. */
+int igb_demux_add(struct igb_demux *demux, u_int64_t stream_id,
+		  igb_demux_cb_t cb, void *arg)
+{
+	struct igb_demux_stream *stream;
+
+	if (demux == NULL || cb == NULL || stream_id == 0)
+		return -EINVAL;
+
+	if (igb_demux_lookup(demux, stream_id,
+			     igb_demux_hash(demux, stream_id)) >= 0)
+		return -EEXIST;
+
+	if (demux->num_streams == demux->max_streams)
+		return -ENOSPC;
+
+	stream = &demux->streams[demux->num_streams];
+	stream->stream_id = stream_id;
+	stream->cb = cb;
+	stream->arg = arg;
+	stream->count = 0;
+
+	igb_demux_insert(demux, stream_id, demux->num_streams++);
+
+	return 0;
+}
+
+/*
+ * Unsubscribe a stream. The last stream takes its place and the table
+ * is rebuilt, which keeps probing free of deleted markers.
+ */
+int igb_demux_del(struct igb_demux *demux, u_int64_t stream_id)
+{
+	unsigned int i;
+	int index;
+
+	if (demux == NULL || stream_id == 0)
+		return -EINVAL;
+
+	index = igb_demux_lookup(demux, stream_id,
+				 igb_demux_hash(demux, stream_id));
+	if (index < 0)
+		return -ENOENT;
+
+	demux->streams[index] = demux->streams[--demux->num_streams];
+
+	memset(demux->keys, 0, demux->nbuckets * IGB_DEMUX_BUCKET *
+	       sizeof(u_int64_t));
+	for (i = 0; i < demux->num_streams; i++)
+		igb_demux_insert(demux, demux->streams[i].stream_id, i);
+
+	return 0;
+}
+
+/*
+ * Dispatch a burst of received packets to the callbacks of their
+ * streams. Packets of no subscribed stream, including any that are not
+ * AVTP stream frames, are stored in miss[], which has room for
+ * num_pkts, and counted in *num_miss. Returns the number of packets
+ * dispatched.
+ */
+int igb_demux_run(struct igb_demux *demux, struct igb_packet **packets,
+		  unsigned int num_pkts, struct igb_packet **miss,
+		  unsigned int *num_miss)
+{
+	struct igb_demux_stream *stream;
+	u_int64_t id[IGB_DEMUX_BATCH];
+	unsigned int bucket[IGB_DEMUX_BATCH];
+	u_int16_t touched[IGB_DEMUX_BATCH];
+	unsigned int i, n, ntouched, done = 0, missed = 0;
+	int index;
+
+	if (demux == NULL || packets == NULL || miss == NULL ||
+	    num_miss == NULL)
+		return -EINVAL;
+
+	for (; num_pkts > 0; packets += n, num_pkts -= n) {
+		n = num_pkts < IGB_DEMUX_BATCH ? num_pkts : IGB_DEMUX_BATCH;
+
+		for (i = 0; i < n; i++) {
+			id[i] = igb_demux_stream_id(packets[i]);
+			bucket[i] = igb_demux_hash(demux, id[i]);
+			__builtin_prefetch(&demux->keys[bucket[i] *
+							IGB_DEMUX_BUCKET]);
+		}
+
+		ntouched = 0;
+		for (i = 0; i < n; i++) {
+			index = id[i] ? igb_demux_lookup(demux, id[i],
+							 bucket[i]) : -1;
+			if (index < 0) {
+				miss[missed++] = packets[i];
+				continue;
+			}
+
+			stream = &demux->streams[index];
+			if (stream->count == 0)
+				touched[ntouched++] = index;
+			stream->out[stream->count++] = packets[i];
+		}
+
+		for (i = 0; i < ntouched; i++) {
+			stream = &demux->streams[touched[i]];
+			stream->cb(stream->arg, stream->stream_id,
+				   stream->out, stream->count);
+			done += stream->count;
+			stream->count = 0;
+		}
+	}
+
+	*num_miss = missed;
+
+	return done;
+}
+
+/*********************************************************************
+ *
+ *  Launch time scheduler
+ *
+ *  Launch-time packets for queues 0 and 1 are held in a min-heap per
+ *  queue, keyed by attime, and only released to the ring once their
+ *  launch time is within the horizon. Far-future frames therefore
+ *  never sit at the head of a ring blocking the frames behind them,
+ *  and the ring holds at most a horizon's worth of traffic. Frames
+ *  whose launch time is closer than min_lead when released (which
+ *  includes ones already in the past) are late: depending on the
+ *  policy they are either handed back to the caller or restamped to
+ *  go out min_lead from now.
+ *
+ *  A scheduler is not locked; it belongs to the thread feeding its
+ *  queues.
+ *
+ **********************************************************************/
+static inline int igb_sched_before(struct igb_sched_entry *a,
+				   struct igb_sched_entry *b)
+{
+	if (a->attime != b->attime)
+		return a->attime < b->attime;
+
+	/* same launch time: keep the enqueue order */
+	return a->seq < b->seq;
+}
+
+static void igb_sched_push(struct igb_sched_heap *heap,
+			   struct igb_sched_entry *ent)
+{
+	unsigned int i = heap->count++, parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!igb_sched_before(ent, &heap->ent[parent]))
+			break;
+		heap->ent[i] = heap->ent[parent];
+		i = parent;
+	}
+	heap->ent[i] = *ent;
+}
+
+static void igb_sched_pop(struct igb_sched_heap *heap)
+{
+	struct igb_sched_entry last;
+	unsigned int i = 0, child;
+
+	last = heap->ent[--heap->count];
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= heap->count)
+			break;
+		if (child + 1 < heap->count &&
+		    igb_sched_before(&heap->ent[child + 1], &heap->ent[child]))
+			child++;
+		if (!igb_sched_before(&heap->ent[child], &last))
+			break;
+		heap->ent[i] = heap->ent[child];
+		i = child;
+	}
+	heap->ent[i] = last;
+}
+
+int igb_sched_init(device_t *dev, struct igb_sched **psched,
+		   unsigned int depth, u_int64_t horizon,
+		   u_int64_t min_lead, int late_policy)
+{
+	struct igb_sched *sched;
+	int i;
+
+	if (dev == NULL || psched == NULL)
+		return -EINVAL;
+
+	if (dev->private_data == NULL)
+		return -ENXIO;
+
+	if (depth == 0 || min_lead > horizon)
+		return -EINVAL;
+
+	if (late_policy != IGB_SCHED_LATE_REJECT &&
+	    late_policy != IGB_SCHED_LATE_RESTAMP)
+		return -EINVAL;
+
+	sched = calloc(1, sizeof(*sched));
+	if (sched == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < IGB_SCHED_QUEUES; i++) {
+		sched->heap[i].ent = calloc(depth,
+					    sizeof(struct igb_sched_entry));
+		if (sched->heap[i].ent == NULL) {
+			igb_sched_free(sched);
+			return -ENOMEM;
+		}
+	}
+
+	sched->dev = dev;
+	sched->depth = depth;
+	sched->horizon = horizon;
+	sched->min_lead = min_lead;
+	sched->late_policy = late_policy;
+
+	*psched = sched;
+
+	return 0;
+}
+
+void igb_sched_free(struct igb_sched *sched)
+{
+	int i;
+
+	if (sched == NULL)
+		return;
+
+	for (i = 0; i < IGB_SCHED_QUEUES; i++)
+		free(sched->heap[i].ent);
+
+	free(sched);
+}
+
+/*
+ * Hold a packet until its launch time comes within the horizon. Only
+ * IGB_PACKET_LAUNCHTIME packets are accepted. The scheduler owns the
+ * packet until igb_sched_run() queues it or returns it as late.
+ */
+int igb_sched_enqueue(struct igb_sched *sched, unsigned int queue_index,
+		      struct igb_packet *packet)
+{
+	struct igb_sched_heap *heap;
+	struct igb_sched_entry ent;
+
+	if (sched == NULL || packet == NULL)
+		return -EINVAL;
+
+	if (queue_index >= IGB_SCHED_QUEUES)
+		return -EINVAL;
+
+	if (!(packet->flags & IGB_PACKET_LAUNCHTIME))
+		return -EINVAL;
+
+	/* would never be accepted by the ring and block the queue */
+	if (igb_tx_segs(packet) < 0)
+		return -EINVAL;
+
+	heap = &sched->heap[queue_index];
+	if (heap->count == sched->depth)
+		return -ENOSPC;
+
+	ent.attime = packet->attime;
+	ent.seq = sched->seq++;
+	ent.packet = packet;
+	igb_sched_push(heap, &ent);
+
+	return 0;
+}
+
+/*
+ * Release every held packet whose launch time is before now + horizon
+ * to its ring, one burst per queue. now is the current PHC time, for
+ * instance from igb_get_wallclock(). Late packets under
+ * IGB_SCHED_LATE_REJECT are stored in late[], up to *num_late of them,
+ * and *num_late is updated to the count returned; any others stay held
+ * for the next call. That policy needs room for at least one late
+ * packet, or a late head would hold its queue forever: -EINVAL
+ * otherwise. Packets that do not fit in a full ring also stay held.
+ * Returns the number of packets queued or a negative error.
+ */
+int igb_sched_run(struct igb_sched *sched, u_int64_t now,
+		  struct igb_packet **late, unsigned int *num_late)
+{
+	struct igb_packet *batch[IGB_SCHED_BATCH];
+	struct igb_sched_entry ent[IGB_SCHED_BATCH];
+	struct igb_sched_heap *heap;
+	struct adapter *adapter;
+	struct tx_ring *txr;
+	unsigned int max_late, nlate = 0;
+	unsigned int q, n, i;
+	int sent, total = 0, error = 0;
+
+	if (sched == NULL)
+		return -EINVAL;
+
+	adapter = (struct adapter *)sched->dev->private_data;
+	if (adapter == NULL || adapter->tx_rings == NULL)
+		return -ENXIO;
+
+	max_late = (late != NULL && num_late != NULL) ? *num_late : 0;
+	if (sched->late_policy == IGB_SCHED_LATE_REJECT && max_late == 0)
+		return -EINVAL;
+
+	for (q = 0; q < IGB_SCHED_QUEUES; q++) {
+		heap = &sched->heap[q];
+		txr = &adapter->tx_rings[q];
+
+		do {
+			n = 0;
+			while (heap->count > 0 && n < IGB_SCHED_BATCH &&
+			       heap->ent[0].attime <= now + sched->horizon) {
+				ent[n] = heap->ent[0];
+
+				if (ent[n].attime < now + sched->min_lead) {
+					if (sched->late_policy ==
+					    IGB_SCHED_LATE_REJECT) {
+						if (nlate == max_late)
+							break;
+						igb_sched_pop(heap);
+						late[nlate++] = ent[n].packet;
+						++txr->tx_late;
+						continue;
+					}
+					/* keep the heap key in step */
+					ent[n].attime = now + sched->min_lead;
+					ent[n].packet->attime = ent[n].attime;
+					++txr->tx_late;
+				}
+
+				igb_sched_pop(heap);
+				batch[n] = ent[n].packet;
+				n++;
+			}
+
+			if (n == 0)
+				break;
+
+			sent = igb_xmit_burst(sched->dev, q, batch, n);
+			if (sent < 0) {
+				error = sent;
+				sent = 0;
+			}
+
+			/* ring full: put back what was not taken */
+			for (i = sent; i < n; i++)
+				igb_sched_push(heap, &ent[i]);
+
+			total += sent;
+			if (error)
+				goto out;
+		} while ((unsigned int)sent == n);
+	}
+
+out:
+	if (num_late != NULL)
+		*num_late = nlate;
+
+	return error ? error : total;
+}
+
+/*
+ * Earliest launch time held for any queue, so the caller knows when
+ * igb_sched_run() next has work. Returns -ENOENT if nothing is held.
+ */
+int igb_sched_next(struct igb_sched *sched, u_int64_t *attime)
+{
+	int q, found = 0;
+
+	if (sched == NULL || attime == NULL)
+		return -EINVAL;
+
+	for (q = 0; q < IGB_SCHED_QUEUES; q++) {
+		if (sched->heap[q].count == 0)
+			continue;
+		if (!found || sched->heap[q].ent[0].attime < *attime)
+			*attime = sched->heap[q].ent[0].attime;
+		found = 1;
+	}
+
+	return found ? 0 : -ENOENT;
+}
+
+void igb_trigger(device_t *dev, u_int32_t data)
+{
+	struct adapter *adapter;
+
+	if (dev == NULL)
+		return;
+
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
+		return;
+
+	if (igb_lock(dev) != 0)
+		return;
+
+	E1000_WRITE_REG(&(adapter->hw), E1000_WUS, data);
+	if (igb_unlock(dev) != 0)
+		return;
+}
+
+void igb_writereg(device_t *dev, u_int32_t reg, u_int32_t data)
+{
+	struct adapter *adapter;
+
+	if (dev == NULL)
+		return;
+
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
+		return;
+
+	E1000_WRITE_REG(&(adapter->hw), reg, data);
+}
+
+void igb_readreg(device_t *dev, u_int32_t reg, u_int32_t *data)
+{
+	struct adapter *adapter;
+
+	if (dev == NULL)
+		return;
+
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
+		return;
+
+	if (data == NULL)
+		return;
+
+	*data = E1000_READ_REG(&(adapter->hw), reg);
+}
+
+/*
+ * Acquire one of the adapter's robust inter-process mutexes, recovering it
+ * if its previous owner died while holding it.
+ */
+static int igb_mutex_lock(struct adapter *adapter, pthread_mutex_t *mutex)
+{
+	int error;
+
+	if (adapter->active != 1)	// detach in progress
+		return -ENXIO;
+
+	error = pthread_mutex_lock(mutex);
+	switch (error) {
+		case 0:
+			break;
+		case EOWNERDEAD:
+			// some process terminated without unlocking the mutex
+			if (pthread_mutex_consistent(mutex) != 0)
+				return -errno;
+			break;
+		default:
+			return -error;
+			break;
+	}
+
+	if (adapter->active != 1) {
+		(void) pthread_mutex_unlock(mutex);
+		return -ENXIO;
+	}
+
+	return 0;
+}
+
+/*
+ * igb_lock() takes the adapter control lock which covers everything
+ * shared between the queues: device registers, the shaper, filters and
+ * time sampling. The transmit fast path only takes its queue lock.
+ */
+int igb_lock(device_t *dev)
+{
+	struct adapter *adapter;
+
+	if (dev == NULL)
+		return -ENODEV;
+
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
+		return -ENXIO;
+
+	if (!adapter->memlock)
+		return -ENXIO;
+
+	return igb_mutex_lock(adapter, adapter->memlock);
+}
+
+int igb_unlock(device_t *dev)
+{
+	struct adapter *adapter;
+
+	if (dev == NULL)
+		return -ENODEV;
+
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
+		return -ENXIO;
+
+	if (!adapter->memlock)
+		return -ENXIO;
+
+	return pthread_mutex_unlock(adapter->memlock);
+}
+
+static int igb_lock_queue(struct tx_ring *txr)
+{
+	if (!txr->lock)
+		return -ENXIO;
+
+	return igb_mutex_lock(txr->adapter, txr->lock);
+}
+
+static void igb_unlock_queue(struct tx_ring *txr)
+{
+	(void) pthread_mutex_unlock(txr->lock);
+}
+
+/*
+ * Take every transmit queue lock, for operations reprogramming the rings.
+ * Queue locks always nest inside the control lock.
+ */
+static int igb_lock_tx_queues(struct adapter *adapter)
+{
+	int i, error;
+
+	if (adapter->tx_rings == NULL)
+		return 0;
+
+	for (i = 0; i < adapter->num_queues; i++) {
+		error = igb_lock_queue(&adapter->tx_rings[i]);
+		if (error != 0) {
+			while (--i >= 0)
+				igb_unlock_queue(&adapter->tx_rings[i]);
+			return error;
+		}
+	}
+
+	return 0;
+}
+
+static void igb_unlock_tx_queues(struct adapter *adapter)
+{
+	int i;
+
+	if (adapter->tx_rings == NULL)
+		return;
+
+	for (i = 0; i < adapter->num_queues; i++)
+		igb_unlock_queue(&adapter->tx_rings[i]);
+}
+
+/*
+ * Extend the nanosecond field of a DMA write-back timestamp to a full
+ * 64-bit PHC time. The write-back only carries SYSTIML, so borrow the
+ * seconds from a PHC sample taken after the descriptor was read: the
+ * write-back happened in the most recent second at or before now.
+ */
+static u_int64_t igb_tx_dmatime(u_int64_t now, u_int32_t ns)
+{
+	u_int64_t dmatime;
+
+	dmatime = now - (now % 1000000000ULL) + ns;
+
+	if (ns > now % 1000000000ULL)
+		dmatime -= 1000000000ULL;
+
+	return dmatime;
+}
+
+/*
+ * Sample the PHC without the control lock. Reading SYSTIML latches
+ * SYSTIMH, and another reader may latch it again before SYSTIMH is
+ * read; that latch is still from after our SYSTIML, so the seconds are
+ * right unless SYSTIML wrapped in between, which the second read of
+ * SYSTIML catches.
+ */
+static u_int64_t igb_read_systim(struct e1000_hw *hw)
+{
+	u_int32_t timl, timh, timl2;
+
+	do {
+		timl = E1000_READ_REG(hw, E1000_SYSTIML);
+		timh = E1000_READ_REG(hw, E1000_SYSTIMH);
+		timl2 = E1000_READ_REG(hw, E1000_SYSTIML);
+	} while (timl2 < timl);
+
+	return (u_int64_t)timh * 1000000000ULL + timl;
+}
+
+/*
+ * Reclaim for rings in head write-back mode. The NIC stores the index of
+ * the next descriptor it will process in host memory, so a frame is done
+ * once its EOP descriptor is behind that index; no descriptor is read or
+ * cleared. Descriptors are not written back in this mode, so dmatime and
+ * latchtime are 0.
+ */
+static int igb_tx_reclaim_head_wb(struct tx_ring *txr, struct igb_packet **out,
+				  int max)
+{
+	struct adapter *adapter = txr->adapter;
+	int num_tx_desc = adapter->num_tx_desc;
+	struct igb_tx_buffer *tx_buffer;
+	struct igb_packet *packet;
+	int first, last, limit, head, done;
+	int count = 0;
+
+	limit = __atomic_load_n(&txr->next_avail_desc, __ATOMIC_ACQUIRE);
+	first = txr->next_to_clean;
+
+	if (first == limit) {
+		txr->queue_status = IGB_QUEUE_IDLE;
+		return 0;
+	}
+
+	head = le32toh(*txr->head_wb);
+	/* number of descriptors the NIC has finished with */
+	done = head - first;
+	if (done < 0)
+		done += num_tx_desc;
+
+	while (count < max && done > 0) {
+		last = txr->tx_buffers[first].next_eop;
+		last -= first;
+		if (last < 0)
+			last += num_tx_desc;
+		/* the EOP of this frame has not been processed yet */
+		if (last >= done)
+			break;
+
+		txr->tx_buffers[first].next_eop = -1;
+		done -= last + 1;
+		first += last;
+
+		if (first >= num_tx_desc)
+			first -= num_tx_desc;
+		tx_buffer = &txr->tx_buffers[first];
+		packet = tx_buffer->packet;
+		if (packet) {
+			packet->dmatime = 0;
+			txr->bytes += packet->len;
+			out[count++] = packet;
+
+			tx_buffer->packet = NULL;
+		}
+		++txr->packets;
+
+		if (++first == num_tx_desc)
+			first = 0;
+	}
+
+	/* hand the cleaned descriptors back to igb_xmit() */
+	__atomic_store_n(&txr->next_to_clean, first, __ATOMIC_RELEASE);
+
+	return count;
+}
+
+/*
+ * Reclaim up to max completed packets from one transmit ring into out[],
+ * returning the number reclaimed. The caller holds the queue (or owns it
+ * in SPSC mode). The DMA time is left as the raw 32-bit nanosecond
+ * write-back, see igb_tx_dmatime().
+ */
+static int igb_tx_reclaim(struct tx_ring *txr, struct igb_packet **out,
+			  int max)
+{
+	struct adapter *adapter = txr->adapter;
+	struct e1000_tx_desc *tx_desc, *eop_desc;
+	struct igb_tx_buffer *tx_buffer;
+	struct igb_packet *packet;
+	int first, last, done, limit;
+	int count = 0;
+
+	if (txr->head_wb)
+		return igb_tx_reclaim_head_wb(txr, out, max);
+
+	/* descriptors up to limit were fully written by igb_xmit() */
+	limit = __atomic_load_n(&txr->next_avail_desc, __ATOMIC_ACQUIRE);
+	first = txr->next_to_clean;
+
+	if (first == limit) {
+		txr->queue_status = IGB_QUEUE_IDLE;
+		return 0;
+	}
+
+	tx_desc = &txr->tx_base[first];
+	tx_buffer = &txr->tx_buffers[first];
+	last = tx_buffer->next_eop;
+	eop_desc = &txr->tx_base[last];
+
+	/*
+	 * What this does is get the index of the
+	 * first descriptor AFTER the EOP of the
+	 * first packet, that way we can do the
+	 * simple comparison on the inner while loop.
+	 */
+	if (++last == adapter->num_tx_desc)
+		last = 0;
+	done = last;
+
+	while (count < max &&
+	       (eop_desc->upper.fields.status & E1000_TXD_STAT_DD)) {
+		/* We clean the range of the packet */
+		while (first != done) {
+			packet = tx_buffer->packet;
+			if (packet) {
+				packet->dmatime = (u_int32_t)tx_desc->buffer_addr;
+
+				/*
+				 * TXSTMPL/H belong to the kernel PTP path,
+				 * the write-back is the transmit time here
+				 */
+				if (packet->flags & IGB_PACKET_LATCHTIME)
+					packet->latchtime = packet->dmatime;
+				txr->bytes += packet->len;
+				out[count++] = packet;
+
+				tx_buffer->packet = NULL;
+			}
+			tx_buffer->next_eop = -1;
+			tx_desc->upper.data = 0;
+			tx_desc->lower.data = 0;
+			tx_desc->buffer_addr = 0;
+
+			if (++first == adapter->num_tx_desc)
+				first = 0;
+
+			tx_buffer = &txr->tx_buffers[first];
+			tx_desc = &txr->tx_base[first];
+		}
+		++txr->packets;
+		/* See if we can continue to the next packet */
+		if (first == limit)
+			break;
+
+		last = tx_buffer->next_eop;
+		eop_desc = &txr->tx_base[last];
+		/* Get new done point */
+		if (++last == adapter->num_tx_desc)
+			last = 0;
+		done = last;
+	}
+
+	/* hand the cleaned descriptors back to igb_xmit() */
+	__atomic_store_n(&txr->next_to_clean, first, __ATOMIC_RELEASE);
+
+	return count;
+}
+
+#define IGB_CLEAN_BATCH	32
+
+/**********************************************************************
+ *
+ *  Examine each tx_buffer in the used queue. If the hardware is done
+ *  processing the packet then return the linked list of associated resources.
+ *
+ *  The DMA time reported here is only the low 32 bits (nanoseconds) of
+ *  the write-back, see igb_clean_queue() for the full 64-bit time.
+ *
+ **********************************************************************/
+void igb_clean(device_t *dev, struct igb_packet **cleaned_packets)
+{
+	struct igb_packet *batch[IGB_CLEAN_BATCH];
+	struct igb_packet *last_reclaimed = NULL;
+	struct adapter *adapter;
+	struct tx_ring *txr;
+	int i, j, n;
+
+	if (dev == NULL)
+		return;
+
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
+		return;
+
+	if (cleaned_packets == NULL)
+		return;
+
+	*cleaned_packets = NULL; /* nothing reclaimed yet */
+
+	for (i = 0; i < adapter->num_queues; i++) {
+		txr = &adapter->tx_rings[i];
+
+		if (igb_tx_begin(txr) != 0)
+			return;
+
+		do {
+			n = igb_tx_reclaim(txr, batch, IGB_CLEAN_BATCH);
+			for (j = 0; j < n; j++) {
+				if (last_reclaimed == NULL)
+					*cleaned_packets = batch[j];
+				else
+					last_reclaimed->next = batch[j];
+				last_reclaimed = batch[j];
+			}
+		} while (n == IGB_CLEAN_BATCH);
+
+		igb_tx_end(txr);
+	}
+}
+
+/**********************************************************************
+ *
+ *  Reclaim up to max completed packets from a single transmit queue
+ *  into out[], in transmit order. Returns the number of packets stored
+ *  or a negative error; packet->next is left untouched.
+ *
+ *  dmatime is the full 64-bit PHC time in nanoseconds. Queues can be
+ *  cleaned independently, each from its own thread.
+ *
+ **********************************************************************/
+int igb_clean_queue(device_t *dev, unsigned int queue_index,
+		    struct igb_packet **out, unsigned int max)
+{
+	struct adapter *adapter;
+	struct e1000_hw *hw;
+	struct tx_ring *txr;
+	u_int64_t now;
+	int error, i;
+
+	if (dev == NULL)
+		return -EINVAL;
+
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
+		return -ENXIO;
+
+	if (adapter->tx_rings == NULL)
+		return -EINVAL;
+
+	if (queue_index >= adapter->num_queues)
+		return -EINVAL;
+
+	if (out == NULL)
+		return -EINVAL;
+
+	txr = &adapter->tx_rings[queue_index];
+	hw = &adapter->hw;
+
+	if (max == 0 || txr->next_to_clean ==
+	    __atomic_load_n(&txr->next_avail_desc, __ATOMIC_ACQUIRE))
+		return 0;
+
+	error = igb_tx_begin(txr);
+	if (error != 0)
+		return error;
+
+	/* a ring never holds more packets than descriptors */
+	if (max > (unsigned int)adapter->num_tx_desc)
+		max = adapter->num_tx_desc;
+
+	error = igb_tx_reclaim(txr, out, (int)max);
+
+	igb_tx_end(txr);
+
+	/* no write-back in head write-back mode, dmatime stays 0 */
+	if (error <= 0 || txr->head_wb)
+		return error;
+
+	/*
+	 * Sample the PHC once for the whole batch, after every descriptor
+	 * in it was read, so that no write-back is later than the sample.
+	 */
+	now = igb_read_systim(hw);
+
+	for (i = 0; i < error; i++) {
+		out[i]->dmatime = igb_tx_dmatime(now,
+						 (u_int32_t)out[i]->dmatime);
+		if (out[i]->flags & IGB_PACKET_LATCHTIME)
+			out[i]->latchtime = out[i]->dmatime;
+	}
+
+	return error;
+}
+
+/*********************************************************************
+ *
+ *  Snapshot the counters of a queue. They are kept by whichever
+ *  thread transmits on or receives from the queue and read here
+ *  without locking, so a value may be one update behind.
+ *
+ **********************************************************************/
+int igb_get_queue_stats(device_t *dev, unsigned int queue_index,
+			struct igb_queue_stats *stats)
+{
+	struct adapter *adapter;
+	struct tx_ring *txr;
+	struct rx_ring *rxr;
+
+	if (dev == NULL || stats == NULL)
+		return -EINVAL;
+
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
+		return -ENXIO;
+
+	if (queue_index >= adapter->num_queues)
+		return -EINVAL;
+
+	memset(stats, 0, sizeof(*stats));
+
+	if (adapter->tx_rings) {
+		txr = &adapter->tx_rings[queue_index];
+		stats->tx_packets = txr->tx_packets;
+		stats->tx_no_desc_avail = txr->no_desc_avail;
+		stats->tx_enospc = txr->tx_enospc;
+		stats->tx_late = txr->tx_late;
+	}
+
+	if (adapter->rx_rings) {
+		rxr = &adapter->rx_rings[queue_index];
+		stats->rx_packets = rxr->rx_packets;
+		stats->rx_bytes = rxr->rx_bytes;
+		stats->rx_discarded = rxr->rx_discarded;
+		stats->rx_refill_fail = rxr->rx_refill_fail;
+	}
+
+	return 0;
+}
+
+/*********************************************************************
+ *
+ *  Allocate memory for the receive rings, and then
+ *  the descriptors associated with each, called only once at attach.
+ *
+ **********************************************************************/
+static int igb_allocate_rx_queues(struct adapter *adapter)
+{
+	struct igb_buf_cmd ubuf;
+	int dev = adapter->ldev;
+	int i, error = 0;
+
+	/* allocate the RX ring struct memory */
+	adapter->rx_rings = (struct rx_ring *) malloc(sizeof(struct rx_ring) *
+						      adapter->num_queues);
+
+	if (adapter->rx_rings == NULL) {
+		error = -ENOMEM;
+		goto rx_fail;
+	}
+
+	memset(adapter->rx_rings, 0, sizeof(struct rx_ring) *
+					    adapter->num_queues);
+
+	for (i = 0; i < adapter->num_queues; i++) {
+
+		if (sem_init(&adapter->rx_rings[i].lock, 0, 1) != 0) {
+			error = errno;
+			goto rx_desc;
+		}
+
+		if (sem_wait(&adapter->rx_rings[i].lock) != 0) {
+			error = errno;
+			goto rx_desc;
+		}
+
+		ubuf.queue = i;
+		error = ioctl(dev, IGB_IOCTL_MAP_RX_RING, &ubuf);
+		if (error < 0) {
+
+			if(error == -EINVAL)
+				goto rx_fail;
+
+			error = EBUSY;
+			goto rx_desc;
+		}
+
+		if (ubuf.physaddr % 128)
+			syslog(LOG_WARNING, "igb: rx ring addr (0x%llx) is not 128 byte-aligned\n",
+			       (unsigned long long)ubuf.physaddr);
+
+		adapter->rx_rings[i].rxdma.paddr = ubuf.physaddr;
+		adapter->rx_rings[i].rxdma.mmap_size = ubuf.mmap_size;
+		adapter->rx_rings[i].rx_base = NULL;
+		adapter->rx_rings[i].rx_base =
+			mmap(NULL, ubuf.mmap_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED, adapter->ldev, ubuf.pa);
+
+		if (adapter->rx_rings[i].rx_base == MAP_FAILED) {
+			error = -ENOMEM;
+			goto rx_desc;
+		}
+
+		adapter->rx_rings[i].adapter = adapter;
+		adapter->rx_rings[i].me = i;
+		adapter->rx_rings[i].buf_size = IGB_RX_BUF_SIZE;
+
+		adapter->num_rx_desc = ubuf.mmap_size /
+				       sizeof(union e1000_adv_rx_desc);
+
+		/*
+		 * num_rx_desc must be always a multiple of 8 because the value of
+		 * RDLEN must be a multipe of 128 and each descriptor has 16 bytes.
+		 */
+		if (adapter->num_rx_desc % 8)
+			syslog(LOG_WARNING, "igb: num_rx_desc(%d) is not a multiple of 8\n",
+			       adapter->num_rx_desc);
+
+		memset((void *)adapter->rx_rings[i].rx_base, 0, ubuf.mmap_size);
+		adapter->rx_rings[i].rx_buffers =
+			(struct igb_rx_buffer *)
+				malloc(sizeof(struct igb_rx_buffer) *
+				       adapter->num_rx_desc);
+
+		if (adapter->rx_rings[i].rx_buffers == NULL) {
+			error = -ENOMEM;
+			goto rx_desc;
+		}
+
+		memset(adapter->rx_rings[i].rx_buffers, 0,
+		       sizeof(struct igb_rx_buffer) * adapter->num_rx_desc);
+
+		if (sem_post(&adapter->rx_rings[i].lock) != 0) {
+			error = errno;
+			goto rx_desc;
+		}
+	}
+
+	return 0;
+
+rx_desc:
+	for (i = 0; i < adapter->num_queues; i++) {
+		if (adapter->rx_rings[i].rx_base)
+			munmap(adapter->rx_rings[i].rx_base,
+			       adapter->rx_rings[i].rxdma.mmap_size);
+		ubuf.queue = i;
+		ioctl(dev, IGB_IOCTL_UNMAP_RX_RING, &ubuf);
+
+		sem_destroy(&adapter->rx_rings[i].lock);
+	};
+rx_fail:
+	free(adapter->rx_rings);
+	adapter->rx_rings = NULL;
+	return error;
+}
+
+static void igb_free_receive_ring(struct rx_ring *rxr)
+{
+	struct adapter *adapter = rxr->adapter;
+	struct igb_rx_buffer *rxbuf;
+	int i;
+
+	for (i = 0; i < adapter->num_rx_desc; i++) {
+		rxbuf = &rxr->rx_buffers[i];
+		rxbuf->next_eop = 0;
+		rxbuf->packet = NULL;
+	}
+}
+
+/* Initialize a receive ring. */
+static void igb_setup_receive_ring(struct rx_ring *rxr)
+{
+	struct adapter *adapter = rxr->adapter;
+
+	(void)sem_wait(&rxr->lock);
+
+	/* pool buffers go back to the pool, to be posted again below */
+	if (rxr->pool)
+		igb_rx_pool_reclaim_ring(rxr);
+
+	/* Clear the ring contents */
+	memset((void *)rxr->rx_base,  0,
+	       (sizeof(union e1000_adv_rx_desc)) * adapter->num_rx_desc);
+
+	memset(rxr->rx_buffers, 0, sizeof(struct igb_rx_buffer) *
+				   rxr->adapter->num_rx_desc);
+
+	/* Free current RX buffer structures */
+	igb_free_receive_ring(rxr);
+
+	/* Setup our descriptor indices */
+	rxr->next_to_check = 0;
+	rxr->next_to_refresh = 0;
+	rxr->fmp = NULL;
+	rxr->lmp = NULL;
+	rxr->rx_split_packets = 0;
+	rxr->rx_bytes = 0;
+
+	/* RDT is written by igb_initialize_receive_units() */
+	if (rxr->pool)
+		(void)igb_rx_pool_fill(rxr);
+
+	(void)sem_post(&rxr->lock);
+}
+
+/* Initialize all receive rings. */
+static void igb_setup_receive_structures(struct adapter *adapter)
+{
+	struct rx_ring *rxr = adapter->rx_rings;
+	int i;
+
+	for (i = 0; i < adapter->num_queues; i++, rxr++)
+		igb_setup_receive_ring(rxr);
+}
+
+/*
+ * SRRCTL for a receive queue: 2 KB packet buffers, plus a header buffer
+ * of hdr_size bytes when header split is on, and the receive time in
+ * front of the frame with timestamp-in-packet.
+ */
+static u32 igb_rx_srrctl(struct rx_ring *rxr)
+{
+	u32 srrctl = 0;
+
+	srrctl |= rxr->buf_size >> E1000_SRRCTL_BSIZEPKT_SHIFT;
+
+	if (rxr->timestamp)
+		srrctl |= E1000_SRRCTL_TIMESTAMP;
+
+	if (rxr->hdr_split) {
+		srrctl |= (rxr->hdr_size << E1000_SRRCTL_BSIZEHDRSIZE_SHIFT) &
+			  E1000_SRRCTL_BSIZEHDRSIZE_MASK;
+		srrctl |= E1000_SRRCTL_DESCTYPE_HDR_SPLIT_ALWAYS;
+	} else {
+		srrctl |= E1000_SRRCTL_DESCTYPE_ADV_ONEBUF;
+	}
+
+	return srrctl;
+}
+
+/* Enable receive unit. */
+static void igb_initialize_receive_units(struct adapter *adapter)
+{
+	struct rx_ring *rxr = adapter->rx_rings;
+	struct e1000_hw *hw = &adapter->hw;
+	u32 rctl, rxcsum;
+	int i;
+
+	/*
+	 * Make sure receives are disabled while setting
+	 * up the descriptor ring
+	 */
+	rctl = E1000_READ_REG(hw, E1000_RCTL);
+	E1000_WRITE_REG(hw, E1000_RCTL, rctl & ~E1000_RCTL_EN);
+
+	/*
+	 * LPE is left as the kernel driver set it for the interface MTU,
+	 * jumbo frames are received over several buffers. The buffer size
+	 * of each queue is in its SRRCTL, which overrides RCTL.SZ.
+	 */
+	rctl |= E1000_RCTL_SZ_2048;
+
+	/* Setup the Base and Length of the Rx Descriptor Rings */
+	for (i = 0; i < adapter->num_queues; i++, rxr++) {
+		u64 bus_addr = rxr->rxdma.paddr;
+		u32 rxdctl, rxdctlpollcnt = 0;
+
+		/* Disable this Queue */
+		E1000_WRITE_REG(hw, E1000_RXDCTL(i), 0);
+		do {
+			rxdctl = E1000_READ_REG(hw, E1000_RXDCTL(i)) & E1000_RXDCTL_QUEUE_ENABLE;
+		} while (rxdctl && ++rxdctlpollcnt < IGB_RXDCTL_MAX_POLL);
+
+		E1000_WRITE_REG(hw, E1000_RDLEN(i),
+				adapter->num_rx_desc *
+					sizeof(union e1000_adv_rx_desc));
+		E1000_WRITE_REG(hw, E1000_RDBAH(i),
+				(uint32_t)(bus_addr >> 32));
+		E1000_WRITE_REG(hw, E1000_RDBAL(i),
+				(uint32_t)bus_addr);
+		E1000_WRITE_REG(hw, E1000_SRRCTL(i), igb_rx_srrctl(rxr));
+
+		/* Enable this Queue */
+		rxdctl = E1000_READ_REG(hw, E1000_RXDCTL(i));
+		rxdctl |= E1000_RXDCTL_QUEUE_ENABLE;
+		rxdctl &= 0xFFF00000;
+		rxdctl |= IGB_RX_PTHRESH;
+		rxdctl |= IGB_RX_HTHRESH << 8;
+		rxdctl |= IGB_RX_WTHRESH << 16;
+		E1000_WRITE_REG(hw, E1000_RXDCTL(i), rxdctl);
+
+		rxdctlpollcnt = 0;
+		do {
+			rxdctl = E1000_READ_REG(hw, E1000_RXDCTL(i)) & E1000_RXDCTL_QUEUE_ENABLE;
+		} while (!rxdctl && ++rxdctlpollcnt < IGB_RXDCTL_MAX_POLL);
+	}
+
+	/*
+	 * Setup for RX MultiQueue
+	 * Non RSS setup
+	 */
+	rxcsum = E1000_READ_REG(hw, E1000_RXCSUM);
+	rxcsum |= E1000_RXCSUM_IPPCSE;
+	/*	rxcsum &= ~E1000_RXCSUM_TUOFL; */
+	E1000_WRITE_REG(hw, E1000_RXCSUM, rxcsum);
+
+	/* Setup the Receive Control Register */
+	rctl &= ~(3 << E1000_RCTL_MO_SHIFT);
+	rctl |= E1000_RCTL_EN | E1000_RCTL_BAM | E1000_RCTL_LBM_NO |
+		E1000_RCTL_RDMTS_HALF;
+	/* Strip CRC bytes. */
+	rctl |= E1000_RCTL_SECRC;
+	/* Make sure VLAN Filters are off */
+	rctl &= ~E1000_RCTL_VFE;
+	/* Don't store bad packets */
+	rctl &= ~E1000_RCTL_SBP;
+
+	/* Enable Receives */
+	E1000_WRITE_REG(hw, E1000_RCTL, rctl);
+
+	/*
+	 * Setup the HW Rx Head and Tail Descriptor Pointers
+	 *   - needs to be after enable
+	 */
+	for (i = 0; i < adapter->num_queues; i++) {
+		rxr = &adapter->rx_rings[i];
+		E1000_WRITE_REG(hw, E1000_RDH(i), rxr->next_to_check);
+		E1000_WRITE_REG(hw, E1000_RDT(i), rxr->next_to_refresh);
+	}
+}
+
+/* Free all receive rings. */
+static void igb_free_receive_structures(struct adapter *adapter)
+{
+	struct rx_ring *rxr = adapter->rx_rings;
+	int i;
+	struct igb_buf_cmd ubuf;
+
+	for (i = 0; i < adapter->num_queues; i++, rxr++) {
+		(void)sem_wait(&adapter->rx_rings[i].lock);
+
+		if (rxr->rx_base) {
+			memset(rxr->rx_base, 0, rxr->rxdma.mmap_size);
+			munmap(rxr->rx_base, rxr->rxdma.mmap_size);
+		}
+		ubuf.queue = i;
+		ioctl(adapter->ldev, IGB_IOCTL_UNMAP_RX_RING, &ubuf);
+		igb_free_receive_buffers(rxr);
+
+		(void)sem_destroy(&adapter->rx_rings[i].lock);
+	}
+
+	free(adapter->rx_rings);
+	adapter->rx_rings = NULL;
+}
+
+
+/* Free receive ring data structures. */
+static void igb_free_receive_buffers(struct rx_ring *rxr)
+{
+	struct adapter *adapter = rxr->adapter;
+	struct igb_rx_buffer *rxbuf;
+	int i;
+
+	/* Cleanup any existing buffers */
+	if (rxr->rx_buffers != NULL) {
+		for (i = 0; i < adapter->num_rx_desc; i++) {
+			rxbuf = &rxr->rx_buffers[i];
+			rxbuf->next_eop = 0;
+			rxbuf->packet = NULL;
+		}
+		if (rxr->rx_buffers != NULL) {
+			free(rxr->rx_buffers);
+			rxr->rx_buffers = NULL;
+		}
+	}
+}
+
+/*
+ * Strip the timestamp the NIC put in front of a received frame and
+ * store it in rxtime, as PHC nanoseconds.
+ */
+static void igb_rx_timestamp(struct igb_packet *packet)
+{
+	u32 *ts = (u32 *)packet->vaddr;
+
+	/* 8 reserved bytes, then SYSTIML and SYSTIMH */
+	packet->rxtime = (u_int64_t)le32toh(ts[3]) * 1000000000ULL +
+			 le32toh(ts[2]);
+	packet->vaddr = (u8 *)packet->vaddr + IGB_TS_HDR_LEN;
+	packet->len -= IGB_TS_HDR_LEN;
+	packet->flags |= IGB_PACKET_RXTIME;
+}
+
+/*
+ * Undo igb_rx_timestamp() before the buffer is posted again. Only a
+ * queue with timestamp-in-packet strips the header, and the receive
+ * path resets IGB_PACKET_RXTIME on every buffer it returns, so the
+ * flag is not taken from the application on other queues.
+ */
+static inline void igb_rx_untimestamp(struct rx_ring *rxr,
+				      struct igb_packet *packet)
+{
+	if (rxr->timestamp && (packet->flags & IGB_PACKET_RXTIME)) {
+		packet->vaddr = (u8 *)packet->vaddr - IGB_TS_HDR_LEN;
+		packet->flags &= ~IGB_PACKET_RXTIME;
+	}
+}
+
+/*********************************************************************
+ *
+ *  Turn header split on (hdr_size bytes, a multiple of 64 up to 960)
+ *  or off (hdr_size 0) for a receive queue. With header split the NIC
+ *  writes the protocol headers of a frame to packet->hdr_paddr and the
+ *  rest to the packet buffer, reporting hdr_len and len respectively,
+ *  so every buffer posted must come with a header buffer flagged
+ *  IGB_PACKET_HDR, see igb_rx_hdr_assign().
+ *
+ *  Call after igb_init() and before any buffer is posted on the queue;
+ *  returns -EBUSY otherwise. igb_init() keeps the setting.
+ *
+ **********************************************************************/
+int igb_set_rx_header_split(device_t *dev, unsigned int queue_index,
+			    unsigned int hdr_size)
+{
+	struct adapter *adapter;
+	struct rx_ring *rxr;
+	int error;
+
+	if (dev == NULL)
+		return -EINVAL;
+
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
+		return -ENXIO;
 
-		/* Enable this Queue */
-		rxdctl = E1000_READ_REG(hw, E1000_RXDCTL(i));
-		rxdctl |= E1000_RXDCTL_QUEUE_ENABLE;
-		rxdctl &= 0xFFF00000;
-		rxdctl |= IGB_RX_PTHRESH;
-		rxdctl |= IGB_RX_HTHRESH << 8;
-		rxdctl |= IGB_RX_WTHRESH << 16;
-		E1000_WRITE_REG(hw, E1000_RXDCTL(i), rxdctl);
+	if (adapter->rx_rings == NULL)
+		return -EINVAL;
 
-		rxdctlpollcnt = 0;
-		do {
-			rxdctl = E1000_READ_REG(hw, E1000_RXDCTL(i)) & E1000_RXDCTL_QUEUE_ENABLE;
-		} while (!rxdctl && ++rxdctlpollcnt < IGB_RXDCTL_MAX_POLL);
+	if (queue_index >= adapter->num_queues)
+		return -EINVAL;
+
+	if (hdr_size % 64 || hdr_size > IGB_RX_HDR_MAX)
+		return -EINVAL;
+
+	rxr = &adapter->rx_rings[queue_index];
+
+	error = igb_lock(dev);
+	if (error != 0)
+		return error;
+
+	if (sem_wait(&rxr->lock) != 0) {
+		error = -errno;
+		igb_unlock(dev);
+		return error;
+	}
+
+	if (rxr->next_to_refresh != rxr->next_to_check ||
+	    rxr->rx_buffers[rxr->next_to_check].packet != NULL) {
+		error = -EBUSY;
+		goto unlock;
+	}
+
+	/* the timestamp would not be in the packet buffer */
+	if (hdr_size && rxr->timestamp) {
+		error = -EINVAL;
+		goto unlock;
+	}
+
+	rxr->hdr_split = hdr_size != 0;
+	rxr->hdr_size = hdr_size;
+	E1000_WRITE_REG(&adapter->hw, E1000_SRRCTL(rxr->me),
+			igb_rx_srrctl(rxr));
+
+unlock:
+	sem_post(&rxr->lock);
+	igb_unlock(dev);
+
+	return error;
+}
+
+/*********************************************************************
+ *
+ *  Turn timestamp-in-packet on or off for a receive queue. The NIC
+ *  then prepends the PHC receive time to each timestamped frame; the
+ *  receive routines strip it and report it in packet->rxtime, flagging
+ *  the packet IGB_PACKET_RXTIME. If receive timestamping is not enabled
+ *  yet it is enabled for all packets; when the kernel side already
+ *  enabled it for PTP only, other frames come without rxtime.
+ *
+ *  Not available together with header split. Call before any buffer
+ *  is posted on the queue; returns -EBUSY otherwise.
+ *
+ **********************************************************************/
+int igb_set_rx_timestamp(device_t *dev, unsigned int queue_index, int enable)
+{
+	struct adapter *adapter;
+	struct e1000_hw *hw;
+	struct rx_ring *rxr;
+	u32 tsyncrxctl;
+	int error;
+
+	if (dev == NULL)
+		return -EINVAL;
+
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
+		return -ENXIO;
+
+	if (adapter->rx_rings == NULL)
+		return -EINVAL;
+
+	if (queue_index >= adapter->num_queues)
+		return -EINVAL;
+
+	rxr = &adapter->rx_rings[queue_index];
+	hw = &adapter->hw;
+
+	error = igb_lock(dev);
+	if (error != 0)
+		return error;
+
+	if (sem_wait(&rxr->lock) != 0) {
+		error = -errno;
+		igb_unlock(dev);
+		return error;
+	}
+
+	/* buffers posted were offset for the current setting */
+	if (rxr->next_to_refresh != rxr->next_to_check ||
+	    rxr->rx_buffers[rxr->next_to_check].packet != NULL) {
+		error = -EBUSY;
+		goto unlock;
+	}
+
+	if (enable && rxr->hdr_split) {
+		error = -EINVAL;
+		goto unlock;
+	}
+
+	if (enable) {
+		tsyncrxctl = E1000_READ_REG(hw, E1000_TSYNCRXCTL);
+		if (!(tsyncrxctl & E1000_TSYNCRXCTL_ENABLED)) {
+			tsyncrxctl &= ~E1000_TSYNCRXCTL_TYPE_MASK;
+			tsyncrxctl |= E1000_TSYNCRXCTL_ENABLED |
+				      E1000_TSYNCRXCTL_TYPE_ALL;
+			E1000_WRITE_REG(hw, E1000_TSYNCRXCTL, tsyncrxctl);
+		}
+	}
+
+	rxr->timestamp = enable ? TRUE : FALSE;
+	E1000_WRITE_REG(hw, E1000_SRRCTL(rxr->me), igb_rx_srrctl(rxr));
+
+unlock:
+	sem_post(&rxr->lock);
+	igb_unlock(dev);
+
+	return error;
+}
+
+/*********************************************************************
+ *
+ *  Set the packet buffer size of a receive queue, a multiple of 1 KB
+ *  from 1 KB to 16 KB (2 KB by default). Frames larger than a buffer
+ *  span several, chained through frag, so small buffers suit queues
+ *  that only see short frames; see igb_rx_buf_assign() to pack them
+ *  into DMA pages. Every buffer posted must be at least this large.
+ *
+ *  Call after igb_init() and before any buffer is posted on the queue;
+ *  returns -EBUSY otherwise. igb_init() keeps the setting.
+ *
+ **********************************************************************/
+int igb_set_rx_buf_size(device_t *dev, unsigned int queue_index,
+			unsigned int buf_size)
+{
+	struct adapter *adapter;
+	struct rx_ring *rxr;
+	int error;
+
+	if (dev == NULL)
+		return -EINVAL;
+
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
+		return -ENXIO;
+
+	if (adapter->rx_rings == NULL)
+		return -EINVAL;
+
+	if (queue_index >= adapter->num_queues)
+		return -EINVAL;
+
+	if (buf_size % IGB_RX_BUF_MIN || buf_size < IGB_RX_BUF_MIN ||
+	    buf_size > IGB_RX_BUF_MAX)
+		return -EINVAL;
+
+	rxr = &adapter->rx_rings[queue_index];
+
+	error = igb_lock(dev);
+	if (error != 0)
+		return error;
+
+	if (sem_wait(&rxr->lock) != 0) {
+		error = -errno;
+		igb_unlock(dev);
+		return error;
+	}
+
+	if (rxr->next_to_refresh != rxr->next_to_check ||
+	    rxr->rx_buffers[rxr->next_to_check].packet != NULL) {
+		error = -EBUSY;
+		goto unlock;
+	}
+
+	rxr->buf_size = buf_size;
+	E1000_WRITE_REG(&adapter->hw, E1000_SRRCTL(rxr->me),
+			igb_rx_srrctl(rxr));
+
+unlock:
+	sem_post(&rxr->lock);
+	igb_unlock(dev);
+
+	return error;
+}
+
+/*
+ * Carve a DMA page into buf_size byte packet buffers and give one to
+ * each packet on the list (linked through next) that has none yet, i.e.
+ * a NULL vaddr. buf_size must be a multiple of 1 KB, so that every
+ * buffer starts 1 KB aligned in the page. The page is carved from its
+ * start, so hand each page to a single call. Returns the number of
+ * packets given a buffer.
+ */
+int igb_rx_buf_assign(struct igb_dma_alloc *page, unsigned int buf_size,
+		      struct igb_packet *packets)
+{
+	unsigned int off = 0;
+	int count = 0;
+
+	if (page == NULL || page->dma_vaddr == NULL)
+		return -EINVAL;
+
+	if (buf_size % IGB_RX_BUF_MIN || buf_size < IGB_RX_BUF_MIN)
+		return -EINVAL;
+
+	for (; packets != NULL; packets = packets->next) {
+		if (packets->vaddr)
+			continue;
+		if (off + buf_size > page->mmap_size)
+			break;
+
+		packets->map.paddr = page->dma_paddr;
+		packets->map.mmap_size = page->mmap_size;
+		packets->offset = off;
+		packets->vaddr = (u8 *)page->dma_vaddr + off;
+		off += buf_size;
+		count++;
+	}
+
+	return count;
+}
+
+/*
+ * Carve a DMA page into hdr_size byte header buffers, densely packed,
+ * and give one to each packet on the list (linked through next) that
+ * has none yet, flagging it IGB_PACKET_HDR. The page is carved from its start, so hand each page
+ * to a single call. Returns the number of packets given a header buffer.
+ */
+int igb_rx_hdr_assign(struct igb_dma_alloc *page, unsigned int hdr_size,
+		      struct igb_packet *packets)
+{
+	unsigned int off = 0;
+	int count = 0;
+
+	if (page == NULL || page->dma_vaddr == NULL || hdr_size == 0)
+		return -EINVAL;
+
+	for (; packets != NULL; packets = packets->next) {
+		if (packets->flags & IGB_PACKET_HDR)
+			continue;
+		if (off + hdr_size > page->mmap_size)
+			break;
+
+		packets->hdr_vaddr = (u8 *)page->dma_vaddr + off;
+		packets->hdr_paddr = page->dma_paddr + off;
+		packets->flags |= IGB_PACKET_HDR;
+		off += hdr_size;
+		count++;
+	}
+
+	return count;
+}
+
+/*
+ * The header address of a receive descriptor. Bit 0 of it is NSE (no
+ * snoop), so without header split it must be 0 whatever the packet
+ * holds.
+ */
+static inline u64 igb_rx_hdr_addr(struct rx_ring *rxr,
+				  struct igb_packet *packet)
+{
+	return rxr->hdr_split ? htole64(packet->hdr_paddr) : 0;
+}
+
+/*
+ *  Refresh mbuf buffers for RX descriptor rings
+ *   - now keeps its own state so discards due to resource
+ *     exhaustion are unnecessary, if an mbuf cannot be obtained
+ *     it just returns, keeping its placeholder, thus it can simply
+ *     be recalled to try again.
+ *
+ */
+int igb_refresh_buffers(device_t *dev, u_int32_t idx,
+			 struct igb_packet **rxbuf_packets, u_int32_t num_bufs)
+{
+	struct igb_packet *cur_pkt;
+	struct adapter *adapter;
+	struct rx_ring *rxr;
+	u_int32_t i, j, bufs_used;
+	bool refreshed = FALSE;
+	int error = 0;
+
+	if (dev == NULL)
+		return -EINVAL;
+
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
+		return -EINVAL;
+
+	if (adapter->active != 1)	// detach in progress
+		return -ENXIO;
+
+	if (rxbuf_packets == NULL)
+		return -EINVAL;
+
+	if (idx > 1)
+		return -EINVAL;
+
+	rxr = &adapter->rx_rings[idx];
+	if (rxr == NULL)
+		return -EINVAL;
+
+	if (sem_trywait(&rxr->lock) != 0)
+		return errno; /* EAGAIN */
+
+	if (adapter->active != 1) {
+		sem_post(&rxr->lock);
+		return -ENXIO;
 	}
 
+	i = j = rxr->next_to_refresh;
+	cur_pkt = *rxbuf_packets;
+
 	/*
-	 * Setup for RX MultiQueue
-	 * Non RSS setup
+	 * Get one descriptor beyond
+	 * our work mark to control
+	 * the loop.
 	 */
-	rxcsum = E1000_READ_REG(hw, E1000_RXCSUM);
-	rxcsum |= E1000_RXCSUM_IPPCSE;
-	/*	rxcsum &= ~E1000_RXCSUM_TUOFL; */
-	E1000_WRITE_REG(hw, E1000_RXCSUM, rxcsum);
+	if (++j == adapter->num_rx_desc)
+		j = 0;
 
-	/* Setup the Receive Control Register */
-	rctl &= ~(3 << E1000_RCTL_MO_SHIFT);
-	rctl |= E1000_RCTL_EN | E1000_RCTL_BAM | E1000_RCTL_LBM_NO |
-		E1000_RCTL_RDMTS_HALF;
-	/* Strip CRC bytes. */
-	rctl |= E1000_RCTL_SECRC;
-	/* Make sure VLAN Filters are off */
-	rctl &= ~E1000_RCTL_VFE;
-	/* Don't store bad packets */
-	rctl &= ~E1000_RCTL_SBP;
+	bufs_used = 0;
+
+	while (bufs_used < num_bufs) {
+		if (!cur_pkt)
+			break;
+		/* the NIC would write the header to address 0 */
+		if (rxr->hdr_split && !(cur_pkt->flags & IGB_PACKET_HDR)) {
+			++rxr->rx_refill_fail;
+			error = -EINVAL;
+			break;
+		}
+		igb_rx_untimestamp(rxr, cur_pkt);
+		rxr->rx_base[i].read.pkt_addr =
+			htole64(cur_pkt->map.paddr + cur_pkt->offset);
+		rxr->rx_base[i].read.hdr_addr = igb_rx_hdr_addr(rxr, cur_pkt);
+		rxr->rx_buffers[i].packet = cur_pkt;
+
+		refreshed = TRUE; /* I feel wefreshed :) */
+
+		i = j; /* our next is precalculated */
+		rxr->next_to_refresh = i;
+		if (++j == adapter->num_rx_desc)
+			j = 0;
+		bufs_used++;
+		cur_pkt = cur_pkt->next;
+	}
+
+	if (refreshed) /* update tail */
+		E1000_WRITE_REG(&adapter->hw,
+				E1000_RDT(rxr->me), rxr->next_to_refresh);
+
+	if (sem_post(&rxr->lock) != 0)
+		return errno;
+
+	return error;
+}
+
+
+/*
+ * Put a buffer back on the ring at next_to_refresh, for frames that are
+ * dropped. The caller holds the ring lock and writes RDT afterwards.
+ */
+static void igb_rx_recycle(struct rx_ring *rxr, struct igb_packet *packet)
+{
+	u32 i = rxr->next_to_refresh;
+
+	igb_rx_untimestamp(rxr, packet);
 
-	/* Enable Receives */
-	E1000_WRITE_REG(hw, E1000_RCTL, rctl);
+	rxr->rx_base[i].read.pkt_addr =
+		htole64(packet->map.paddr + packet->offset);
+	rxr->rx_base[i].read.hdr_addr = igb_rx_hdr_addr(rxr, packet);
+	rxr->rx_buffers[i].packet = packet;
 
-	/*
-	 * Setup the HW Rx Head and Tail Descriptor Pointers
-	 *   - needs to be after enable
-	 */
-	for (i = 0; i < adapter->num_queues; i++) {
-		rxr = &adapter->rx_rings[i];
-		E1000_WRITE_REG(hw, E1000_RDH(i), rxr->next_to_check);
-		E1000_WRITE_REG(hw, E1000_RDT(i), rxr->next_to_refresh);
-	}
+	if (++i == rxr->adapter->num_rx_desc)
+		i = 0;
+	rxr->next_to_refresh = i;
 }
 
-/* Free all receive rings. */
-static void igb_free_receive_structures(struct adapter *adapter)
+/*
+ * Zero the written back descriptors from first up to (not including)
+ * last, in at most two runs.
+ */
+static void igb_rx_clear_desc(struct rx_ring *rxr, u32 first, u32 last)
 {
-	struct rx_ring *rxr = adapter->rx_rings;
-	int i;
-	struct igb_buf_cmd ubuf;
+	u32 num_rx_desc = rxr->adapter->num_rx_desc;
 
-	for (i = 0; i < adapter->num_queues; i++, rxr++) {
-		(void)sem_wait(&adapter->rx_rings[i].lock);
+	if (first == last)
+		return;
 
-		if (rxr->rx_base) {
-			memset(rxr->rx_base, 0, rxr->rxdma.mmap_size);
-			munmap(rxr->rx_base, rxr->rxdma.mmap_size);
-		}
-		ubuf.queue = i;
-		ioctl(adapter->ldev, IGB_IOCTL_UNMAP_RX_RING, &ubuf);
-		igb_free_receive_buffers(rxr);
+	if (first < last) {
+		memset(&rxr->rx_base[first], 0,
+		       (last - first) * sizeof(union e1000_adv_rx_desc));
+		return;
+	}
 
-		(void)sem_destroy(&adapter->rx_rings[i].lock);
+	memset(&rxr->rx_base[first], 0,
+	       (num_rx_desc - first) * sizeof(union e1000_adv_rx_desc));
+	memset(&rxr->rx_base[0], 0, last * sizeof(union e1000_adv_rx_desc));
+}
+
+/*
+ * Receive buffer pool. Buffers carved from DMA pages live either in the
+ * pool, on the ring or with the application, which hands them back with
+ * igb_rx_free(); the pool is under a spinlock since that may happen on
+ * any thread. The ring side is refilled from the pool, under the ring
+ * lock, in batches once enough descriptors are empty.
+ */
+static void igb_rx_pool_put(struct igb_rx_pool *pool, struct igb_packet *packet)
+{
+	pthread_spin_lock(&pool->lock);
+	for (; packet != NULL && pool->nfree < pool->num;
+	     packet = igb_next_frag(packet))
+		pool->free[pool->nfree++] = packet;
+	pthread_spin_unlock(&pool->lock);
+}
+
+/* Return every buffer on the ring, and a partial frame, to the pool. */
+static void igb_rx_pool_reclaim_ring(struct rx_ring *rxr)
+{
+	struct igb_rx_pool *pool = rxr->pool;
+	int i;
+
+	for (i = 0; i < rxr->adapter->num_rx_desc; i++) {
+		if (rxr->rx_buffers[i].packet == NULL)
+			continue;
+		rxr->rx_buffers[i].packet->frag = NULL;
+		igb_rx_pool_put(pool, rxr->rx_buffers[i].packet);
+		rxr->rx_buffers[i].packet = NULL;
 	}
 
-	free(adapter->rx_rings);
-	adapter->rx_rings = NULL;
+	if (rxr->fmp)
+		igb_rx_pool_put(pool, rxr->fmp);
+	rxr->fmp = NULL;
+	rxr->lmp = NULL;
 }
 
+/*
+ * Post pool buffers on every empty descriptor, once at least the
+ * watermark of them are empty. Returns the number posted; the caller
+ * holds the ring lock and writes RDT.
+ */
+static unsigned int igb_rx_pool_fill(struct rx_ring *rxr)
+{
+	struct igb_rx_pool *pool = rxr->pool;
+	int num_rx_desc = rxr->adapter->num_rx_desc;
+	int posted, empty, n = 0;
+
+	posted = (int)rxr->next_to_refresh - (int)rxr->next_to_check;
+	if (posted < 0)
+		posted += num_rx_desc;
+	/* one descriptor stays empty so that RDT never reaches RDH */
+	empty = num_rx_desc - 1 - posted;
 
-/* Free receive ring data structures. */
-static void igb_free_receive_buffers(struct rx_ring *rxr)
+	if (empty < (int)pool->watermark)
+		return 0;
+
+	pthread_spin_lock(&pool->lock);
+	for (; n < empty && pool->nfree > 0; n++)
+		igb_rx_recycle(rxr, pool->free[--pool->nfree]);
+	pthread_spin_unlock(&pool->lock);
+
+	/* the application holds on to too many buffers */
+	if (n < empty)
+		++rxr->rx_refill_fail;
+
+	return n;
+}
+
+/*
+ * Receive up to max frames from a ring into out[], the caller holds the
+ * ring lock. A frame larger than one receive buffer spans several
+ * descriptors; its buffers are returned chained through packet->frag
+ * as on transmit, each with its own len, and the application refreshes every one of
+ * them as it would a single-buffer frame. A frame whose EOP has not been
+ * written back yet is kept on the ring (fmp/lmp) for the next call.
+ *
+ * Upcoming descriptors and the headers of the returned frames are
+ * prefetched, and the written back descriptors are cleared in bulk once
+ * the batch is done rather than one at a time. Dropped frames have their
+ * buffers put straight back on the ring, and queues with a buffer pool
+ * are refilled from it, all with a single RDT write.
+ */
+static unsigned int igb_rx_clean(struct rx_ring *rxr, struct igb_packet **out,
+				 unsigned int max)
 {
 	struct adapter *adapter = rxr->adapter;
-	struct igb_rx_buffer *rxbuf;
-	int i;
+	struct igb_packet *drop = NULL, *drop_tail = NULL;
+	struct igb_packet *packet;
+	union e1000_adv_rx_desc *cur;
+	u32 first, desc, num_rx_desc, staterr;
+	u16 hdr_info;
+	unsigned int count = 0;
+	bool refreshed = FALSE;
 
-	/* Cleanup any existing buffers */
-	if (rxr->rx_buffers != NULL) {
-		for (i = 0; i < adapter->num_rx_desc; i++) {
-			rxbuf = &rxr->rx_buffers[i];
-			rxbuf->next_eop = 0;
-			rxbuf->packet = NULL;
+	num_rx_desc = adapter->num_rx_desc;
+	first = desc = rxr->next_to_check;
+
+	while (count < max) {
+		cur = &rxr->rx_base[desc];
+
+		staterr = le32toh(cur->wb.upper.status_error);
+		if ((staterr & E1000_RXD_STAT_DD) == 0)
+			break;
+
+		/* the NIC writes back in order, look ahead for the next ones */
+		__builtin_prefetch(&rxr->rx_base[(desc + IGB_RX_PREFETCH) %
+						 num_rx_desc]);
+
+		packet = rxr->rx_buffers[desc].packet;
+		rxr->rx_buffers[desc].packet = NULL;
+
+		packet->len = le16toh(cur->wb.upper.length);
+		packet->frag = NULL;
+		packet->flags &= ~(IGB_PACKET_FRAG | IGB_PACKET_RXTIME);
+		packet->hdr_len = 0;
+
+		if (rxr->fmp == NULL) {
+			/* the receive time is in front of the first buffer */
+			if (rxr->timestamp && (staterr & E1000_RXDADV_STAT_TSIP))
+				igb_rx_timestamp(packet);
+
+			/*
+			 * with header split, the headers are in the first
+			 * buffer; frames the NIC did not split (SPH clear)
+			 * are all in the packet buffer
+			 */
+			hdr_info = le16toh(cur->wb.lower.lo_dword.hs_rss.hdr_info);
+			if (rxr->hdr_split && (hdr_info & E1000_RXDADV_SPH))
+				packet->hdr_len = (hdr_info &
+						   E1000_RXDADV_HDRBUFLEN_MASK) >>
+						  E1000_RXDADV_HDRBUFLEN_SHIFT;
+			rxr->fmp = packet;
+		} else {
+			rxr->lmp->frag = packet;
+			rxr->lmp->flags |= IGB_PACKET_FRAG;
 		}
-		if (rxr->rx_buffers != NULL) {
-			free(rxr->rx_buffers);
-			rxr->rx_buffers = NULL;
+		rxr->lmp = packet;
+
+		rxr->rx_bytes += packet->len;
+
+		if (++desc == num_rx_desc)
+			desc = 0;
+
+		if (!(staterr & E1000_RXD_STAT_EOP))
+			continue;
+
+		packet = rxr->fmp;
+		rxr->fmp = NULL;
+
+		/*
+		 * Free the frame (all segments) if we're at EOP and
+		 * it's an error.
+		 *
+		 * The datasheet states that EOP + status is only valid
+		 * for the final segment in a multi-segment frame.
+		 */
+		if (staterr & E1000_RXDEXT_ERR_FRAME_ERR_MASK) {
+			++rxr->rx_discarded;
+			if (drop == NULL)
+				drop = packet;
+			else
+				drop_tail->frag = packet;
+			drop_tail = rxr->lmp;
+			continue;
 		}
+
+		__builtin_prefetch(packet->hdr_len ? packet->hdr_vaddr :
+				   packet->vaddr);
+		out[count++] = packet;
+
+		++rxr->rx_packets;
+	}
+
+	rxr->next_to_check = desc;
+
+	/* clear first, recycled buffers may land in the range just consumed */
+	igb_rx_clear_desc(rxr, first, desc);
+
+	if (drop) {
+		for (packet = drop; packet != NULL; packet = packet->frag)
+			igb_rx_recycle(rxr, packet);
+		refreshed = TRUE;
 	}
+
+	if (rxr->pool && igb_rx_pool_fill(rxr))
+		refreshed = TRUE;
+
+	if (refreshed)
+		E1000_WRITE_REG(&adapter->hw, E1000_RDT(rxr->me),
+				rxr->next_to_refresh);
+
+	return count;
 }
 
-/*
- *  Refresh mbuf buffers for RX descriptor rings
- *   - now keeps its own state so discards due to resource
- *     exhaustion are unnecessary, if an mbuf cannot be obtained
- *     it just returns, keeping its placeholder, thus it can simply
- *     be recalled to try again.
+/**********************************************************************
  *
- */
-int igb_refresh_buffers(device_t *dev, u_int32_t idx,
-			 struct igb_packet **rxbuf_packets, u_int32_t num_bufs)
+ *  Examine each rx_buffer in the used queue. If the hardware is done
+ *  processing the packet then return the linked list of associated resources.
+ *  Frames spanning several buffers are chained through packet->frag,
+ *  each but the last flagged IGB_PACKET_FRAG.
+ *
+ **********************************************************************/
+int igb_receive(device_t *dev, unsigned int queue_index,
+					struct igb_packet **received_packets, u_int32_t *count)
 {
-	struct igb_packet *cur_pkt;
+	struct igb_packet *batch[IGB_RX_BATCH];
 	struct adapter *adapter;
 	struct rx_ring *rxr;
-	u_int32_t i, j, bufs_used;
-	bool refreshed = FALSE;
+	u_int32_t max_pkt = 0;
+	unsigned int n, i;
+	struct igb_packet *prev_pkt = NULL;
 
 	if (dev == NULL)
 		return -EINVAL;
 
 	adapter = (struct adapter *)dev->private_data;
 	if (adapter == NULL)
-		return -EINVAL;
+		return -ENXIO;
 
 	if (adapter->active != 1)	// detach in progress
 		return -ENXIO;
 
-	if (rxbuf_packets == NULL)
+	if (queue_index > adapter->num_queues)
 		return -EINVAL;
 
-	if (idx > 1)
+	rxr = &(adapter->rx_rings[queue_index]);
+	if (!rxr)
 		return -EINVAL;
 
-	rxr = &adapter->rx_rings[idx];
-	if (rxr == NULL)
+	if (count == NULL)
+		return -EINVAL;
+
+	max_pkt = *count;
+	*count  = 0;
+
+	if (received_packets == NULL)
 		return -EINVAL;
 
+	*received_packets = NULL; /* nothing reclaimed yet */
+
 	if (sem_trywait(&rxr->lock) != 0)
 		return errno; /* EAGAIN */
 
@@ -1673,185 +4596,360 @@ int igb_refresh_buffers(device_t *dev, u_int32_t idx,
 		return -ENXIO;
 	}
 
-	i = j = rxr->next_to_refresh;
-	cur_pkt = *rxbuf_packets;
-
-	/*
-	 * Get one descriptor beyond
-	 * our work mark to control
-	 * the loop.
+	/* Main clean loop - receive packets until no more
+	 * received_packets[]
 	 */
-	if (++j == adapter->num_rx_desc)
-		j = 0;
+	do {
+		n = max_pkt - *count;
+		if (n > IGB_RX_BATCH)
+			n = IGB_RX_BATCH;
+
+		n = igb_rx_clean(rxr, batch, n);
+		for (i = 0; i < n; i++) {
+			if (*received_packets == NULL)
+				*received_packets = batch[i];
+			if (prev_pkt)
+				prev_pkt->next = batch[i];
+			prev_pkt = batch[i];
+		}
+		*count += n;
+	} while (n == IGB_RX_BATCH && *count < max_pkt);
+
+	if (prev_pkt)
+		prev_pkt->next = NULL;
+
+	if (sem_post(&rxr->lock) != 0)
+		return errno;
+
+	if (*received_packets == NULL) {
+		/* nothing reclaimed yet */
+		errno = EAGAIN;
+		return errno;
+	}
+
+	return 0;
+}
+
+/**********************************************************************
+ *
+ *  Receive up to max packets from a queue into out[], in arrival order.
+ *  Returns the number of packets stored, 0 if none were pending, or a
+ *  negative error; packet->next is left untouched. Frames spanning
+ *  several buffers are chained through packet->frag, each but the
+ *  last flagged IGB_PACKET_FRAG.
+ *
+ **********************************************************************/
+int igb_receive_burst(device_t *dev, unsigned int queue_index,
+		      struct igb_packet **out, unsigned int max)
+{
+	struct adapter *adapter;
+	struct rx_ring *rxr;
+	unsigned int count;
+
+	if (dev == NULL)
+		return -EINVAL;
+
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
+		return -ENXIO;
+
+	if (adapter->active != 1)	// detach in progress
+		return -ENXIO;
+
+	if (adapter->rx_rings == NULL)
+		return -EINVAL;
+
+	if (queue_index >= adapter->num_queues)
+		return -EINVAL;
+
+	if (out == NULL)
+		return -EINVAL;
+
+	rxr = &adapter->rx_rings[queue_index];
+
+	if (sem_trywait(&rxr->lock) != 0)
+		return -errno; /* EAGAIN */
+
+	if (adapter->active != 1) {
+		sem_post(&rxr->lock);
+		return -ENXIO;
+	}
+
+	count = igb_rx_clean(rxr, out, max);
+
+	if (sem_post(&rxr->lock) != 0)
+		return -errno;
+
+	return count;
+}
+
+/* Release a receive buffer pool and its DMA pages. */
+static void igb_rx_pool_destroy(device_t *dev, struct igb_rx_pool *pool)
+{
+	unsigned int i;
+
+	for (i = 0; i < pool->npages; i++)
+		igb_dma_free_page(dev, &pool->pages[i]);
+
+	pthread_spin_destroy(&pool->lock);
+	free(pool->pages);
+	free(pool->free);
+	igb_numa_free(pool->packets, pool->num * sizeof(struct igb_packet));
+	free(pool);
+}
+
+/*********************************************************************
+ *
+ *  Let libigb own the receive buffers of a queue. num_bufs buffers of
+ *  the queue buffer size are carved from igb_dma_malloc_region()
+ *  regions (pages with older kernel modules), plus header buffers if
+ *  the queue uses header split, and posted on the ring. The receive
+ *  routines then refill the ring from the pool on their own, with a
+ *  single RDT write per batch, and the application hands each frame
+ *  back with igb_rx_free() instead of calling igb_refresh_buffers().
+ *
+ *  Call after igb_init(), igb_set_rx_buf_size() and
+ *  igb_set_rx_header_split(), before any buffer is posted on the
+ *  queue; returns -EBUSY otherwise, and -EINVAL if a buffer does not
+ *  fit in a DMA page. The pool is released by igb_detach().
+ *
+ **********************************************************************/
+int igb_rx_pool_init(device_t *dev, unsigned int queue_index,
+		     unsigned int num_bufs)
+{
+	struct igb_packet *packet;
+	struct igb_rx_pool *pool;
+	struct adapter *adapter;
+	struct rx_ring *rxr;
+	struct igb_dma_alloc *page;
+	unsigned int i, off, per_page, hdr = 0;
+	u_int64_t size;
+	int error;
+
+	if (dev == NULL)
+		return -EINVAL;
+
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
+		return -ENXIO;
+
+	if (adapter->rx_rings == NULL)
+		return -EINVAL;
+
+	if (queue_index >= adapter->num_queues)
+		return -EINVAL;
+
+	if (num_bufs == 0)
+		return -EINVAL;
+
+	rxr = &adapter->rx_rings[queue_index];
+	if (rxr->pool != NULL)
+		return -EBUSY;
+
+	pool = calloc(1, sizeof(*pool));
+	if (pool == NULL)
+		return -ENOMEM;
+
+	pool->num = num_bufs;
+	pool->packets = igb_numa_zalloc(adapter,
+					num_bufs * sizeof(struct igb_packet));
+	pool->free = calloc(num_bufs, sizeof(struct igb_packet *));
+	if (pool->packets == NULL || pool->free == NULL) {
+		error = -ENOMEM;
+		goto err_free;
+	}
+
+	if (pthread_spin_init(&pool->lock, PTHREAD_PROCESS_PRIVATE) != 0) {
+		error = -ENOMEM;
+		goto err_free;
+	}
+
+	/* carve the packet buffers, then the header buffers */
+	for (i = 0; i < num_bufs || (rxr->hdr_split && hdr < num_bufs);) {
+		if (pool->npages % 16 == 0) {
+			page = realloc(pool->pages, (pool->npages + 16) *
+				       sizeof(struct igb_dma_alloc));
+			if (page == NULL) {
+				error = -ENOMEM;
+				goto err_pages;
+			}
+			pool->pages = page;
+		}
+
+		if (i < num_bufs)
+			size = (u_int64_t)(num_bufs - i) * rxr->buf_size;
+		else
+			size = (u_int64_t)(num_bufs - hdr) * rxr->hdr_size;
+		if (size > IGB_DMA_REGION_MAX)
+			size = IGB_DMA_REGION_MAX;
+
+		page = &pool->pages[pool->npages];
+		error = igb_dma_malloc_buffers(dev, page, (unsigned int)size);
+		if (error != 0)
+			goto err_pages;
+		pool->npages++;
+
+		if (i < num_bufs) {
+			per_page = page->mmap_size / rxr->buf_size;
+			if (per_page == 0) {
+				error = -EINVAL;
+				goto err_pages;
+			}
+			for (off = 0; off < per_page && i < num_bufs; off++, i++) {
+				packet = &pool->packets[i];
+				packet->map.paddr = page->dma_paddr;
+				packet->map.mmap_size = page->mmap_size;
+				packet->offset = off * rxr->buf_size;
+				packet->vaddr = (u8 *)page->dma_vaddr +
+						packet->offset;
+			}
+			continue;
+		}
+
+		per_page = page->mmap_size / rxr->hdr_size;
+		for (off = 0; off < per_page && hdr < num_bufs; off++, hdr++) {
+			packet = &pool->packets[hdr];
+			packet->hdr_vaddr = (u8 *)page->dma_vaddr +
+					    off * rxr->hdr_size;
+			packet->hdr_paddr = page->dma_paddr +
+					    off * rxr->hdr_size;
+			packet->flags |= IGB_PACKET_HDR;
+		}
+	}
 
-	bufs_used = 0;
+	for (i = 0; i < num_bufs; i++)
+		pool->free[i] = &pool->packets[num_bufs - 1 - i];
+	pool->nfree = num_bufs;
 
-	while (bufs_used < num_bufs) {
-		if (!cur_pkt)
-			break;
-		rxr->rx_base[i].read.pkt_addr =
-			htole64(cur_pkt->map.paddr + cur_pkt->offset);
-		rxr->rx_buffers[i].packet = cur_pkt;
+	pool->watermark = adapter->num_rx_desc / 8;
+	if (pool->watermark == 0)
+		pool->watermark = 1;
 
-		refreshed = TRUE; /* I feel wefreshed :) */
+	if (sem_wait(&rxr->lock) != 0) {
+		error = -errno;
+		goto err_pages;
+	}
 
-		i = j; /* our next is precalculated */
-		rxr->next_to_refresh = i;
-		if (++j == adapter->num_rx_desc)
-			j = 0;
-		bufs_used++;
-		cur_pkt = cur_pkt->next;
+	if (rxr->next_to_refresh != rxr->next_to_check ||
+	    rxr->rx_buffers[rxr->next_to_check].packet != NULL) {
+		sem_post(&rxr->lock);
+		error = -EBUSY;
+		goto err_pages;
 	}
 
-	if (refreshed) /* update tail */
-		E1000_WRITE_REG(&adapter->hw,
-				E1000_RDT(rxr->me), rxr->next_to_refresh);
+	rxr->pool = pool;
+	if (igb_rx_pool_fill(rxr))
+		E1000_WRITE_REG(&adapter->hw, E1000_RDT(rxr->me),
+				rxr->next_to_refresh);
 
-	if (sem_post(&rxr->lock) != 0)
-		return errno;
+	sem_post(&rxr->lock);
 
 	return 0;
-}
 
+err_pages:
+	igb_rx_pool_destroy(dev, pool);
+	return error;
 
-/**********************************************************************
- *
- *  Examine each rx_buffer in the used queue. If the hardware is done
- *  processing the packet then return the linked list of associated resources.
- *
- **********************************************************************/
-int igb_receive(device_t *dev, unsigned int queue_index,
-					struct igb_packet **received_packets, u_int32_t *count)
+err_free:
+	free(pool->free);
+	igb_numa_free(pool->packets, pool->num * sizeof(struct igb_packet));
+	free(pool);
+	return error;
+}
+
+/*
+ * Hand a frame received on a pool-managed queue back to the pool, with
+ * all the buffers chained through frag.
+ */
+void igb_rx_free(device_t *dev, unsigned int queue_index,
+		 struct igb_packet *packet)
 {
 	struct adapter *adapter;
 	struct rx_ring *rxr;
-	union e1000_adv_rx_desc *cur;
-	bool eop = FALSE;
-	u_int32_t staterr = 0;
-	u_int32_t desc    = 0;
-	u_int32_t max_pkt = 0;
-	struct igb_packet *curr_pkt = NULL;
-	struct igb_packet *prev_pkt = NULL;
 
-	if (dev == NULL)
-		return -EINVAL;
+	if (dev == NULL || packet == NULL)
+		return;
 
 	adapter = (struct adapter *)dev->private_data;
-	if (adapter == NULL)
-		return -ENXIO;
-
-	if (adapter->active != 1)	// detach in progress
-		return -ENXIO;
+	if (adapter == NULL || adapter->rx_rings == NULL)
+		return;
 
-	if (queue_index > adapter->num_queues)
-		return -EINVAL;
+	if (queue_index >= adapter->num_queues)
+		return;
 
-	rxr = &(adapter->rx_rings[queue_index]);
-	if (!rxr)
-		return -EINVAL;
+	rxr = &adapter->rx_rings[queue_index];
+	if (rxr->pool == NULL)
+		return;
 
-	if (count == NULL)
-		return -EINVAL;
+	igb_rx_pool_put(rxr->pool, packet);
+}
 
-	max_pkt = *count;
-	*count  = 0;
+/*
+ * The igb_avb descriptor of an attached device, to sleep on with poll()
+ * or epoll once its queues are armed with igb_arm_queue().
+ */
+int igb_get_fd(device_t *dev)
+{
+	struct adapter *adapter;
 
-	if (received_packets == NULL)
+	if (dev == NULL)
 		return -EINVAL;
 
-	*received_packets = NULL; /* nothing reclaimed yet */
-
-	if (sem_trywait(&rxr->lock) != 0)
-		return errno; /* EAGAIN */
-
-	if (adapter->active != 1) {
-		sem_post(&rxr->lock);
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
 		return -ENXIO;
-	}
-
-	/* Main clean loop - receive packets until no more
-	 * received_packets[]
-	 */
-	for (desc = rxr->next_to_check; *count < max_pkt;) {
-		cur = &(rxr->rx_base[desc]);
-#ifdef DEBUG
-		if (i%2)
-			printf("\033[2A");
-
-		printf("desc.status_error=%x desc.length=%x desc.vlan=%x desc.rss=%x desc.pkt_info=%x desc.hdr_info=%x\n",
-				cur->wb.upper.status_error,
-				cur->wb.upper.length,
-				cur->wb.upper.vlan,
-				cur->wb.lower.hi_dword.rss,
-				cur->wb.lower.lo_dword.hs_rss.pkt_info,
-				cur->wb.lower.lo_dword.hs_rss.hdr_info);
-#endif
-		staterr = le32toh(cur->wb.upper.status_error);
-		if ((staterr & E1000_RXD_STAT_DD) == 0)
-			break;
 
-		cur->wb.upper.status_error = 0;
+	return adapter->ldev;
+}
 
-		eop = ((staterr & E1000_RXD_STAT_EOP) ==
-				E1000_RXD_STAT_EOP);
+/*********************************************************************
+ *
+ *  Arm poll() wake-ups for a queue. With IGB_ARM_RX the igb_get_fd()
+ *  descriptor turns readable once the receive queue interrupts, with
+ *  IGB_ARM_TX writable once the transmit queue does, and stays so
+ *  until the queue is armed again. Interrupts from before arming are
+ *  forgotten, so check the ring once armed and only then sleep:
+ *
+ *	igb_arm_queue(dev, 0, IGB_ARM_RX);
+ *	if (igb_receive_burst(dev, 0, pkts, n) == 0)
+ *		poll(&pfd, 1, timeout);
+ *
+ *  The queue must have been attached through this device, flags 0
+ *  disarms it.
+ *
+ **********************************************************************/
+int igb_arm_queue(device_t *dev, unsigned int queue_index, int flags)
+{
+	struct igb_arm_cmd arm = {0};
+	struct adapter *adapter;
 
-		if (eop) {
-			/*
-			 * Free the frame (all segments) if we're at EOP and
-			 * it's an error.
-			 *
-			 * The datasheet states that EOP + status is only valid
-			 * for the final segment in a multi-segment frame.
-			 */
-			if (staterr & E1000_RXDEXT_ERR_FRAME_ERR_MASK) {
-				++rxr->rx_discarded;
-				printf ("discard error packet\n");
-				igb_refresh_buffers(dev, queue_index,
-						&rxr->rx_buffers[desc].packet, 1);
-			} else {
-				/*
-				 * add new packet to list of received packets
-				 * to return
-				 */
-				curr_pkt = rxr->rx_buffers[desc].packet;
-				curr_pkt->len = cur->wb.upper.length;
+	if (dev == NULL)
+		return -EINVAL;
 
-				if (*received_packets == NULL)
-					*received_packets = curr_pkt;
-				if (prev_pkt)
-					prev_pkt->next = curr_pkt;
-				prev_pkt = curr_pkt;
-				(*count)++;
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
+		return -ENXIO;
 
-				++rxr->rx_packets;
-			}
-		} else {
-			/* multi-segment frame is not supported yet */
-			++rxr->rx_discarded;
-			printf ("discard non-eop packet\n");
-			igb_refresh_buffers(dev, queue_index,
-					&rxr->rx_buffers[desc].packet, 1);
-		}
-next_desc:
-		/* Advance our pointers to the next descriptor. */
-		if (++desc == adapter->num_rx_desc)
-			desc = 0;
-	}
+	if (queue_index >= adapter->num_queues)
+		return -EINVAL;
 
-	rxr->next_to_check = desc;
+	if (flags & ~(IGB_ARM_RX | IGB_ARM_TX))
+		return -EINVAL;
 
-	if (sem_post(&rxr->lock) != 0)
-		return errno;
+	arm.queue = queue_index;
+	arm.flags = flags;
 
-	if (*received_packets == NULL) {
-		/* nothing reclaimed yet */
-		errno = EAGAIN;
-		return errno;
-	}
+	if (ioctl(adapter->ldev, IGB_IOCTL_ARM, &arm) < 0)
+		return -errno;
 
 	return 0;
 }
 
+int igb_disarm_queue(device_t *dev, unsigned int queue_index)
+{
+	return igb_arm_queue(dev, queue_index, 0);
+}
+
 #define MAX_ITER 32
 #define MIN_WALLCLOCK_TSC_WINDOW 80 /* cycles */
 #define MIN_SYSCLOCK_WINDOW 72 /* ns */
@@ -2347,6 +5445,7 @@ int igb_setup_flex_filter(device_t *dev, unsigned int queue_id,
 	u32 i = 0, j, k;
 	u32 fhft, wufc;
 	u_int8_t *filter_buf = filter;
+	int error = 0;
 
 	if (dev == NULL)
 		return -EINVAL;
@@ -2367,8 +5466,8 @@ int igb_setup_flex_filter(device_t *dev, unsigned int queue_id,
 	if (filter_len % 8) {
 		unsigned int aligned_filter_len = ((filter_len + (8 - 1)) / 8) * 8;
 
-		printf ("warning: filter_len(%d) should be a 8 byte aligned value\n",
-					filter_len);
+		syslog(LOG_WARNING, "igb: filter_len(%d) should be a 8 byte aligned value\n",
+		       filter_len);
 
 		filter_buf = calloc(1, aligned_filter_len);
 		if (!filter_buf)
@@ -2420,6 +5519,11 @@ int igb_setup_flex_filter(device_t *dev, unsigned int queue_id,
 	 * mask[6] |= 0x3F;
 	 */
 
+	if (igb_lock(dev) != 0) {
+		error = -ENXIO;
+		goto free_buf;
+	}
+
 	while (i < filter_len) {
 		for (j = 0; j < 8; j += 4) {
 			fhft = 0;
@@ -2442,10 +5546,13 @@ int igb_setup_flex_filter(device_t *dev, unsigned int queue_id,
 	wufc |= (E1000_WUFC_FLX0 << filter_id) | E1000_WUFC_FLEX_HQ;
 	E1000_WRITE_REG(hw, E1000_WUFC, wufc);
 
+	igb_unlock(dev);
+
+free_buf:
 	if (filter_buf && (filter_buf != filter))
 		free(filter_buf);
 
-	return 0;
+	return error;
 }
 
 int igb_clear_flex_filter(device_t *dev, unsigned int filter_id)
@@ -2467,35 +5574,207 @@ int igb_clear_flex_filter(device_t *dev, unsigned int filter_id)
 
 	hw = &adapter->hw;
 
+	if (igb_lock(dev) != 0)
+		return -ENXIO;
+
 	wufc = E1000_READ_REG(hw, E1000_WUFC);
 	wufc &= ~(E1000_WUFC_FLX0 << filter_id);
 	E1000_WRITE_REG(hw, E1000_WUFC, wufc);
 
+	igb_unlock(dev);
+
+	return 0;
+}
+
+/*
+ * Steer received frames of an EtherType (e.g. 0x22F0 AVTP, 0x88F7 gPTP)
+ * to a queue with one of the 8 EType queue filters (ETQF). Filter 3 is
+ * where the kernel driver has the hardware timestamp gPTP frames; that
+ * stays enabled when the filter is reused for the same EtherType.
+ */
+int igb_setup_etype_filter(device_t *dev, unsigned int queue_id,
+			   unsigned int filter_id, u_int16_t etype)
+{
+	struct adapter *adapter;
+	struct e1000_hw *hw;
+	u32 etqf, old;
+
+	if (dev == NULL)
+		return -EINVAL;
+
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
+		return -ENXIO;
+
+	if (filter_id > 7)
+		return -EINVAL;
+
+	if (queue_id > 1)
+		return -EINVAL;
+
+	hw = &adapter->hw;
+
+	if (igb_lock(dev) != 0)
+		return -ENXIO;
+
+	etqf = E1000_ETQF_FILTER_ENABLE | E1000_ETQF_QUEUE_ENABLE |
+	       ((queue_id << E1000_ETQF_QUEUE_SHIFT) & E1000_ETQF_QUEUE_MASK) |
+	       etype;
+
+	old = E1000_READ_REG(hw, E1000_ETQF(filter_id));
+	if ((old & E1000_ETQF_FILTER_ENABLE) &&
+	    (old & E1000_ETQF_ETYPE_MASK) == etype)
+		etqf |= old & E1000_ETQF_1588;
+
+	E1000_WRITE_REG(hw, E1000_ETQF(filter_id), etqf);
+
+	igb_unlock(dev);
+
+	return 0;
+}
+
+/*
+ * Stop steering with an EType queue filter, a filter that also time
+ * stamps (see igb_setup_etype_filter()) is left doing just that.
+ */
+int igb_clear_etype_filter(device_t *dev, unsigned int filter_id)
+{
+	struct adapter *adapter;
+	struct e1000_hw *hw;
+	u32 etqf;
+
+	if (dev == NULL)
+		return -EINVAL;
+
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
+		return -ENXIO;
+
+	if (filter_id > 7)
+		return -EINVAL;
+
+	hw = &adapter->hw;
+
+	if (igb_lock(dev) != 0)
+		return -ENXIO;
+
+	etqf = E1000_READ_REG(hw, E1000_ETQF(filter_id));
+	if (etqf & E1000_ETQF_1588)
+		etqf &= ~(E1000_ETQF_QUEUE_ENABLE | E1000_ETQF_QUEUE_MASK);
+	else
+		etqf = 0;
+	E1000_WRITE_REG(hw, E1000_ETQF(filter_id), etqf);
+
+	igb_unlock(dev);
+
+	return 0;
+}
+
+/*
+ * Steer received 802.1Q tagged frames of a VLAN priority (PCP) to a
+ * queue with the VLAN priority queue filter (VLAPQF). EType filters
+ * take precedence.
+ */
+int igb_setup_vlan_prio_filter(device_t *dev, unsigned int queue_id,
+			       unsigned int prio)
+{
+	struct adapter *adapter;
+	struct e1000_hw *hw;
+	u32 vlapqf;
+
+	if (dev == NULL)
+		return -EINVAL;
+
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
+		return -ENXIO;
+
+	if (prio > 7)
+		return -EINVAL;
+
+	if (queue_id > 1)
+		return -EINVAL;
+
+	hw = &adapter->hw;
+
+	if (igb_lock(dev) != 0)
+		return -ENXIO;
+
+	vlapqf = E1000_READ_REG(hw, E1000_VLAPQF);
+	vlapqf &= ~(E1000_VLAPQF_QUEUE_SEL(prio, E1000_VLAPQF_QUEUE_MASK) |
+		    E1000_VLAPQF_P_VALID(prio));
+	vlapqf |= E1000_VLAPQF_QUEUE_SEL(prio, queue_id) |
+		  E1000_VLAPQF_P_VALID(prio);
+	E1000_WRITE_REG(hw, E1000_VLAPQF, vlapqf);
+
+	igb_unlock(dev);
+
+	return 0;
+}
+
+int igb_clear_vlan_prio_filter(device_t *dev, unsigned int prio)
+{
+	struct adapter *adapter;
+	struct e1000_hw *hw;
+	u32 vlapqf;
+
+	if (dev == NULL)
+		return -EINVAL;
+
+	adapter = (struct adapter *)dev->private_data;
+	if (adapter == NULL)
+		return -ENXIO;
+
+	if (prio > 7)
+		return -EINVAL;
+
+	hw = &adapter->hw;
+
+	if (igb_lock(dev) != 0)
+		return -ENXIO;
+
+	vlapqf = E1000_READ_REG(hw, E1000_VLAPQF);
+	vlapqf &= ~(E1000_VLAPQF_QUEUE_SEL(prio, E1000_VLAPQF_QUEUE_MASK) |
+		    E1000_VLAPQF_P_VALID(prio));
+	E1000_WRITE_REG(hw, E1000_VLAPQF, vlapqf);
+
+	igb_unlock(dev);
+
 	return 0;
 }
 
-static int igb_create_lock(struct adapter *adapter)
+static int igb_create_lock(struct adapter *adapter, const char *dev_path)
 {
 	int error = -1;
 	int fd = -1;
+	int i;
 	bool locked = false;
 	struct flock fl;
 	struct stat stat;
 	mode_t fmode = S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP;
+	char name[sizeof(IGB_SEM) + IGB_BIND_NAMESZ + 1];
+	char *c;
 
 	bool attr_allocated = false;
 	pthread_mutexattr_t attr;
 
-	if (!adapter) {
+	if (!adapter || !dev_path) {
 		errno = EINVAL;
 		goto err;
 	}
 
-	if (adapter->memlock) {	// already created
+	if (adapter->locks) {	// already created
 		errno = EINVAL;
 		goto err;
 	}
 
+	// one lock domain per adapter, a '/' is not allowed past the first one
+	snprintf(name, sizeof(name), "%s.%.*s", IGB_SEM, IGB_BIND_NAMESZ - 1,
+		 dev_path);
+	for (c = name + 1; *c; c++)
+		if (*c == '/')
+			*c = '_';
+
 	/*
 	 * inter-process syncronization
 	 *
@@ -2509,17 +5788,20 @@ static int igb_create_lock(struct adapter *adapter)
 	 * of service condition.
 	 */
 
-	fd = shm_open(IGB_SEM, O_RDWR|O_CREAT|O_CLOEXEC, fmode);
+	fd = shm_open(name, O_RDWR|O_CREAT|O_CLOEXEC, fmode);
 	if (fd < 0)
 		goto err;
 
 	(void) fchmod(fd, fmode); // just to make sure fmode is applied
 
-	// shared memory holding the mutex instance
-	adapter->memlock = (pthread_mutex_t*) mmap(NULL, sizeof(pthread_mutex_t),
-							PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-	if (!adapter->memlock)
+	// shared memory holding the mutex instances
+	adapter->locks = (struct igb_lock_domain *)
+		mmap(NULL, sizeof(struct igb_lock_domain),
+		     PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (adapter->locks == MAP_FAILED) {
+		adapter->locks = NULL;
 		goto err;
+	}
 
 	/*
 	 * Exclusive access lock
@@ -2554,7 +5836,7 @@ static int igb_create_lock(struct adapter *adapter)
 		 * file-size becomes non-zero and given that when other processes
 		 * attach lib igb we can skip the initialization code for the mutex.
 		 */
-		if (ftruncate(fd, sizeof(pthread_mutex_t)) != 0)
+		if (ftruncate(fd, sizeof(struct igb_lock_domain)) != 0)
 			goto err;
 
 		if (pthread_mutexattr_init(&attr) != 0)
@@ -2570,10 +5852,16 @@ static int igb_create_lock(struct adapter *adapter)
 		if (pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) != 0)
 			goto err;
 
-		if (pthread_mutex_init(adapter->memlock, &attr) != 0)
+		if (pthread_mutex_init(&adapter->locks->ctrl, &attr) != 0)
 			goto err;
+
+		for (i = 0; i < IGB_MAX_TX_QUEUES; i++)
+			if (pthread_mutex_init(&adapter->locks->txq[i],
+					       &attr) != 0)
+				goto err;
 	}
 
+	adapter->memlock = &adapter->locks->ctrl;
 	error = 0;
 err:
 	// no actual effect but to avoid a warning from a static code analyzer
@@ -2582,9 +5870,10 @@ err:
 
 	if (error != 0) {
 		error = -errno;
-		if (adapter && adapter->memlock) {
-			(void) munmap(adapter->memlock, sizeof(pthread_mutex_t));
-			adapter->memlock = NULL;
+		if (adapter && adapter->locks) {
+			(void) munmap(adapter->locks,
+				      sizeof(struct igb_lock_domain));
+			adapter->locks = NULL;
 		}
 	}
 
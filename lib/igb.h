@@ -44,7 +44,14 @@ struct resource {
 
 /* datastructure used to transmit a timed packet */
 #define IGB_PACKET_LAUNCHTIME	1	/* control when packet transmitted */
-#define IGB_PACKET_LATCHTIME	2	/* grab a timestamp of transmission */
+#define IGB_PACKET_LATCHTIME	2	/* report the transmit DMA time */
+#define IGB_PACKET_VLAN		4	/* insert vlan_tci as an 802.1Q tag */
+#define IGB_PACKET_IPV4_CSUM	8	/* insert the IPv4 header checksum */
+#define IGB_PACKET_UDP_CSUM	16	/* insert the UDP checksum, the field
+					 * must hold the pseudo-header sum */
+#define IGB_PACKET_RXTIME	32	/* received with rxtime, set by libigb */
+#define IGB_PACKET_FRAG		64	/* frag points to the next buffer */
+#define IGB_PACKET_HDR		128	/* hdr_vaddr/hdr_paddr are set */
 
 struct igb_packet {
 	struct resource map;	/* bus_dma map for packet */
@@ -54,7 +61,70 @@ struct igb_packet {
 	u_int32_t flags;
 	u_int64_t attime;	/* launchtime */
 	u_int64_t dmatime;	/* when dma tx desc wb*/
+	u_int64_t latchtime;	/* dmatime, with IGB_PACKET_LATCHTIME */
 	struct igb_packet *next;	/* used in the clean routine */
+	struct igb_packet *frag;	/* next segment, with IGB_PACKET_FRAG */
+	u_int16_t vlan_tci;	/* PCP/DEI/VID, with IGB_PACKET_VLAN */
+	u_int8_t l2_len;	/* MAC header length for csum offload, 0 = 14 */
+	u_int8_t l3_len;	/* IP header length for csum offload, 0 = 20 */
+	void *hdr_vaddr;	/* header buffer, receive with header split */
+	u_int64_t hdr_paddr;
+	u_int16_t hdr_len;	/* header bytes received in hdr_vaddr */
+	u_int64_t rxtime;	/* PHC receive time, with IGB_PACKET_RXTIME */
+};
+
+/*
+ * Preformatted Ethernet/VLAN/AVTP header of a stream, copied to the
+ * front of each packet by igb_stream_template_apply(). avtp_offset is
+ * where the AVTP stream header starts (after the Ethernet/VLAN header).
+ */
+#define IGB_STREAM_HDR_MAX	64
+
+struct igb_stream_template {
+	u_int8_t hdr[IGB_STREAM_HDR_MAX] __attribute__((aligned(16)));
+	u_int32_t hdr_len;
+	u_int32_t avtp_offset;
+};
+
+/*
+ * Launch time scheduler. Packets are released to their ring once their
+ * launch time is less than horizon ns away; packets with less than
+ * min_lead ns to go by then are late and are either returned to the
+ * caller or restamped to now + min_lead.
+ */
+#define IGB_SCHED_LATE_REJECT	0
+#define IGB_SCHED_LATE_RESTAMP	1
+
+struct igb_sched;
+
+/* fixed size DMA buffers with their packets, see igb_arena_init() */
+struct igb_arena;
+
+/*
+ * AVTP stream demultiplexer. igb_demux_run() looks up the stream_id of
+ * each received AVTP frame and hands the frames of each subscribed
+ * stream, in order, to its callback; the callback owns them from then.
+ */
+struct igb_demux;
+
+typedef void (*igb_demux_cb_t)(void *arg, u_int64_t stream_id,
+			       struct igb_packet **packets,
+			       unsigned int num_pkts);
+
+/* poll() wake-ups armed by igb_arm_queue() */
+#define IGB_ARM_RX	1	/* readable on a receive interrupt */
+#define IGB_ARM_TX	2	/* writable on a transmit interrupt */
+
+/* per-queue counters, see igb_get_queue_stats() */
+struct igb_queue_stats {
+	u_int64_t rx_packets;
+	u_int64_t rx_bytes;
+	u_int64_t rx_discarded;		/* frames dropped with errors */
+	u_int64_t rx_refill_fail;	/* refills short of buffers */
+	u_int64_t tx_packets;
+	u_int64_t tx_no_desc_avail;	/* times the ring was too full */
+	u_int64_t tx_enospc;		/* packets turned away by a full ring */
+	u_int64_t tx_late;		/* late launch times, igb_sched_run() */
 };
 
 typedef struct _device_t {
@@ -77,6 +147,29 @@ struct igb_dma_alloc {
 	unsigned int mmap_size;
 };
 
+/*
+ * Application memory pinned for DMA by igb_pin_buffer(): busaddr[i] is
+ * the bus address of page i of the range, page 0 being the one holding
+ * addr. igb_pinned_frags() turns any part of it into igb_packet segments.
+ */
+#define IGB_PIN_WRITE		1	/* the NIC may write it (receive) */
+
+struct igb_pinned {
+	void *addr;
+	size_t len;
+	u_int64_t *busaddr;
+	unsigned int npages;
+	unsigned int page_size;
+	u_int64_t handle;
+};
+
+/* igb_set_numa_node() */
+#define IGB_NUMA_DEVICE		(-1)	/* the NIC's own node */
+
+/* igb_dma_malloc_region() */
+#define IGB_DMA_REGION_MAX	(2 * 1024 * 1024)
+#define IGB_DMA_HUGE		1	/* a 2 MB aligned IGB_DMA_REGION_MAX */
+
 int igb_probe(device_t *dev);
 int igb_attach(char *dev_path, device_t *pdev);
 int igb_attach_rx(device_t *pdev);
@@ -86,15 +179,88 @@ int igb_suspend(device_t *dev);
 int igb_resume(device_t *dev);
 int igb_init(device_t *dev);
 int igb_dma_malloc_page(device_t *dev, struct igb_dma_alloc *page);
+int igb_dma_malloc_region(device_t *dev, struct igb_dma_alloc *region,
+			  unsigned int size, int flags);
 void igb_dma_free_page(device_t *dev, struct igb_dma_alloc *page);
+int igb_pin_buffer(device_t *dev, struct igb_pinned *pin, void *addr,
+		   size_t len, int flags);
+void igb_unpin_buffer(device_t *dev, struct igb_pinned *pin);
+int igb_pinned_frags(const struct igb_pinned *pin, const void *addr,
+		     unsigned int len, struct igb_packet *frags,
+		     unsigned int num_frags);
+int igb_get_numa_node(device_t *dev, int *dev_node);
+int igb_set_numa_node(device_t *dev, int node);
+int igb_dma_malloc_pages(device_t *dev, struct igb_dma_alloc *pages,
+			 unsigned int num_pages);
+void igb_dma_free_pages(device_t *dev, struct igb_dma_alloc *pages,
+			unsigned int num_pages);
+int igb_arena_init(device_t *dev, struct igb_arena **parena,
+		   unsigned int buf_size, unsigned int num_bufs);
+void igb_arena_free(struct igb_arena *arena);
+struct igb_packet *igb_arena_get(struct igb_arena *arena);
+int igb_arena_get_burst(struct igb_arena *arena, struct igb_packet **packets,
+			unsigned int num_pkts);
+int igb_arena_put(struct igb_arena *arena, struct igb_packet *packet);
+int igb_arena_put_burst(struct igb_arena *arena, struct igb_packet **packets,
+			unsigned int num_pkts);
 int igb_xmit(device_t *dev, unsigned int queue_index,
 	     struct igb_packet *packet);
+int igb_xmit_burst(device_t *dev, unsigned int queue_index,
+		   struct igb_packet **packets, unsigned int num_pkts);
+int igb_set_tx_spsc(device_t *dev, unsigned int queue_index, int enable);
+int igb_set_tx_head_wb(device_t *dev, unsigned int queue_index, int enable);
+int igb_stream_template_init(struct igb_stream_template *tmpl,
+			     const void *hdr, unsigned int hdr_len,
+			     unsigned int avtp_offset);
+int igb_stream_template_apply(const struct igb_stream_template *tmpl,
+			      struct igb_packet *packet, u_int8_t seqnum,
+			      u_int32_t avtp_time, int tv,
+			      u_int16_t data_len);
+int igb_demux_init(struct igb_demux **pdemux, unsigned int max_streams);
+void igb_demux_free(struct igb_demux *demux);
+int igb_demux_add(struct igb_demux *demux, u_int64_t stream_id,
+		  igb_demux_cb_t cb, void *arg);
+int igb_demux_del(struct igb_demux *demux, u_int64_t stream_id);
+int igb_demux_run(struct igb_demux *demux, struct igb_packet **packets,
+		  unsigned int num_pkts, struct igb_packet **miss,
+		  unsigned int *num_miss);
+int igb_sched_init(device_t *dev, struct igb_sched **psched,
+		   unsigned int depth, u_int64_t horizon,
+		   u_int64_t min_lead, int late_policy);
+void igb_sched_free(struct igb_sched *sched);
+int igb_sched_enqueue(struct igb_sched *sched, unsigned int queue_index,
+		      struct igb_packet *packet);
+int igb_sched_run(struct igb_sched *sched, u_int64_t now,
+		  struct igb_packet **late, unsigned int *num_late);
+int igb_sched_next(struct igb_sched *sched, u_int64_t *attime);
+int igb_set_rx_header_split(device_t *dev, unsigned int queue_index,
+			    unsigned int hdr_size);
+int igb_set_rx_timestamp(device_t *dev, unsigned int queue_index, int enable);
+int igb_set_rx_buf_size(device_t *dev, unsigned int queue_index,
+			unsigned int buf_size);
+int igb_rx_buf_assign(struct igb_dma_alloc *page, unsigned int buf_size,
+		      struct igb_packet *packets);
+int igb_rx_hdr_assign(struct igb_dma_alloc *page, unsigned int hdr_size,
+		      struct igb_packet *packets);
 int igb_refresh_buffers(device_t *dev, u_int32_t idx,
 			 struct igb_packet **rxbuf_packets,
 			 u_int32_t num_bufs);
 int igb_receive(device_t *dev, unsigned int queue_index, 
 	     struct igb_packet **received_packets, u_int32_t *count);
+int igb_receive_burst(device_t *dev, unsigned int queue_index,
+		      struct igb_packet **out, unsigned int max);
+int igb_rx_pool_init(device_t *dev, unsigned int queue_index,
+		     unsigned int num_bufs);
+void igb_rx_free(device_t *dev, unsigned int queue_index,
+		 struct igb_packet *packet);
+int igb_get_fd(device_t *dev);
+int igb_arm_queue(device_t *dev, unsigned int queue_index, int flags);
+int igb_disarm_queue(device_t *dev, unsigned int queue_index);
 void igb_clean(device_t *dev, struct igb_packet **cleaned_packets);
+int igb_clean_queue(device_t *dev, unsigned int queue_index,
+		    struct igb_packet **out, unsigned int max);
+int igb_get_queue_stats(device_t *dev, unsigned int queue_index,
+			struct igb_queue_stats *stats);
 int igb_get_wallclock(device_t *dev, u_int64_t *curtime, u_int64_t *rdtsc);
 int igb_gettime(device_t *dev, clockid_t clk_id, u_int64_t *curtime,
 		struct timespec *system_time);
@@ -106,6 +272,12 @@ int igb_setup_flex_filter(device_t *dev, unsigned int queue_id,
 			  unsigned int filter_id, unsigned int filter_len,
 			  u_int8_t *filter, u_int8_t *mask);
 int igb_clear_flex_filter(device_t *dev, unsigned int filter_id);
+int igb_setup_etype_filter(device_t *dev, unsigned int queue_id,
+			   unsigned int filter_id, u_int16_t etype);
+int igb_clear_etype_filter(device_t *dev, unsigned int filter_id);
+int igb_setup_vlan_prio_filter(device_t *dev, unsigned int queue_id,
+			       unsigned int prio);
+int igb_clear_vlan_prio_filter(device_t *dev, unsigned int prio);
 void igb_trigger(device_t *dev, u_int32_t data);
 void igb_readreg(device_t *dev, u_int32_t reg, u_int32_t *data);
 void igb_writereg(device_t *dev, u_int32_t reg, u_int32_t data);
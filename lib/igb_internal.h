@@ -64,9 +64,39 @@
  */
 #define IGB_DBA_ALIGN			128
 
+#define IGB_CACHELINE_SIZE		64
+#define __igb_cacheline_aligned	__attribute__((aligned(IGB_CACHELINE_SIZE)))
+
 #define SPEED_MODE_BIT (1<<21)		/* On PCI-E MACs only */
 
 #define IGB_MAX_SCATTER		64
+
+/* packet flags which need a context descriptor */
+#define IGB_PACKET_CTX_FLAGS	(IGB_PACKET_LAUNCHTIME | IGB_PACKET_VLAN | \
+				 IGB_PACKET_IPV4_CSUM | IGB_PACKET_UDP_CSUM)
+#define IGB_IPV4_HDR_LEN	20
+
+#define IGB_RX_PREFETCH		4	/* descriptors read ahead on receive */
+#define IGB_RX_BATCH		32	/* frames per igb_rx_clean() in igb_receive() */
+#define IGB_RX_HDR_MAX		960	/* largest SRRCTL.BSIZEHEADER */
+#define IGB_TS_HDR_LEN		16	/* timestamp in front of a frame */
+#define IGB_RX_BUF_SIZE		2048	/* default SRRCTL.BSIZEPACKET */
+#define IGB_RX_BUF_MIN		1024	/* BSIZEPACKET is in 1 KB units */
+#define IGB_RX_BUF_MAX		16384
+
+/* IEEE 1722 AVTP stream header layout, offsets from the AVTP subtype */
+#define IGB_AVTP_STREAM_HDR_LEN		24
+#define IGB_AVTP_TV_OFFSET		1
+#define IGB_AVTP_TV			0x01
+#define IGB_AVTP_SEQNUM_OFFSET		2
+#define IGB_AVTP_TIMESTAMP_OFFSET	12
+#define IGB_AVTP_DATA_LEN_OFFSET	20
+#define IGB_AVTP_SV_OFFSET		1
+#define IGB_AVTP_SV			0x80	/* stream_id valid */
+#define IGB_AVTP_STREAM_ID_OFFSET	4
+#define IGB_AVTP_ETHERTYPE		0x22F0
+#define IGB_VLAN_ETHERTYPE		0x8100
+#define IGB_VLAN_HDR_LEN		4
 #define IGB_VFTA_SIZE		128
 #define IGB_BR_SIZE		4096	/* ring buf size */
 #define IGB_TSO_SIZE		(65535 + sizeof(struct ether_vlan_header))
@@ -75,6 +105,7 @@
 #define IGB_PKTTYPE_MASK	0x0000FFF0
 #define ETH_ZLEN		60
 #define ETH_ADDR_LEN		6
+#define ETH_HDR_LEN		14
 
 
 /* Queue bit defines */
@@ -98,13 +129,96 @@
 /* RXDCTL.ENABLE bit poll retries */
 #define IGB_RXDCTL_MAX_POLL		(5)
 
+/* I210 transmit queues, each has a lock in the adapter lock domain */
+#define IGB_MAX_TX_QUEUES		4
+
+/*
+ * Inter-process locks of one adapter, kept in a shared memory object
+ * named after the adapter's PCI address.
+ */
+struct igb_lock_domain {
+	pthread_mutex_t ctrl;	/* device wide registers, shaper, filters */
+	pthread_mutex_t txq[IGB_MAX_TX_QUEUES];	/* transmit fast path */
+};
+
 struct igb_tx_buffer {
 	int next_eop; /* Index of the desc to watch */
 	struct igb_packet *packet; /* app-relevant handle */
 };
 
+/* packet arena, see igb_arena_init() */
+struct igb_arena {
+	u_int64_t head;	/* tag << 32 | free stack top index + 1 */
+	u_int32_t *next __igb_cacheline_aligned;	/* index + 1, 0 ends */
+	struct igb_packet *packets;	/* cache line aligned */
+	void **vaddr;			/* buffer start of each packet */
+	unsigned int num;
+	unsigned int buf_size;
+	device_t *dev;
+	struct igb_dma_alloc *regions;
+	unsigned int nregions;
+};
+
+/* launch time scheduler, see igb_sched_init() */
+#define IGB_SCHED_QUEUES	2	/* queues with launch time support */
+#define IGB_SCHED_BATCH		32	/* packets per igb_xmit_burst() */
+
+struct igb_sched_entry {
+	u_int64_t attime;
+	u_int64_t seq;
+	struct igb_packet *packet;
+};
+
+struct igb_sched_heap {
+	struct igb_sched_entry *ent;
+	unsigned int count;
+};
+
+struct igb_sched {
+	device_t *dev;
+	unsigned int depth;	/* packets held per queue */
+	u_int64_t horizon;
+	u_int64_t min_lead;
+	int late_policy;
+	u_int64_t seq;
+	struct igb_sched_heap heap[IGB_SCHED_QUEUES];
+};
+
+/*
+ * AVTP stream demultiplexer, see igb_demux_init(). Stream IDs are kept
+ * in an open addressed table of two-key buckets, probed linearly, with
+ * the key 0 marking an empty slot; keys fill a bucket in order, so an
+ * empty second slot ends a probe.
+ */
+#define IGB_DEMUX_BUCKET	2	/* keys per bucket, one SSE2 compare */
+#define IGB_DEMUX_BATCH		32	/* packets parsed ahead of the probes */
+#define IGB_DEMUX_HDR_LEN	(ETH_HDR_LEN + IGB_VLAN_HDR_LEN + \
+				 IGB_AVTP_STREAM_ID_OFFSET + 8)
+
+struct igb_demux_stream {
+	u_int64_t stream_id;
+	igb_demux_cb_t cb;
+	void *arg;
+	unsigned int count;
+	struct igb_packet *out[IGB_DEMUX_BATCH];
+};
+
+struct igb_demux {
+	u_int64_t *keys;	/* IGB_DEMUX_BUCKET per bucket, 16 aligned */
+	u_int16_t *slot;	/* index in streams[] of each key */
+	unsigned int nbuckets;	/* a power of two */
+	unsigned int shift;	/* 64 - log2(nbuckets) */
+	unsigned int num_streams;
+	unsigned int max_streams;
+	struct igb_demux_stream *streams;
+};
+
 /*
  * Transmit ring: one per queue
+ *
+ * The producer (igb_xmit) and consumer (igb_clean) state live on
+ * separate cache lines. The free descriptor count is derived from
+ * next_avail_desc and next_to_clean rather than kept in a shared counter.
  */
 struct tx_ring {
 	struct adapter *adapter;
@@ -112,26 +226,46 @@ struct tx_ring {
 	struct resource txdma;
 	struct e1000_tx_desc *tx_base;
 	struct igb_tx_buffer *tx_buffers;
-	u32 next_avail_desc;
-	u32 next_to_clean;
-
-	u16 tx_avail;
-
-	u32 bytes;
-	u32 packets;
+	pthread_mutex_t *lock;
+	int spsc;	/* single producer/single consumer, no queue lock */
+	volatile u32 *head_wb;	/* head written back by the NIC, or NULL */
 
 	int tdt;
 	int tdh;
-	u64 no_desc_avail;
-	u64 tx_packets;
 	int queue_status;
-};
+
+	/* producer */
+	u32 next_avail_desc __igb_cacheline_aligned;
+	u32 clean_cache;	/* last next_to_clean seen by the producer */
+	int ctx_launch;		/* loaded context holds a launch time */
+	u64 no_desc_avail;	/* times the ring was too full */
+	u64 tx_packets;
+	u64 tx_enospc;		/* packets turned away by a full ring */
+	u64 tx_late;		/* late launch times, see igb_sched_run() */
+
+	/* consumer */
+	u32 next_to_clean __igb_cacheline_aligned;
+	u32 bytes;
+	u32 packets;
+} __igb_cacheline_aligned;
 
 struct igb_rx_buffer {
 	int next_eop; /* Index of the desc to watch */
 	struct igb_packet *packet; /* app-relevant handle */
 };
 
+/* receive buffers owned by libigb, see igb_rx_pool_init() */
+struct igb_rx_pool {
+	pthread_spinlock_t lock;	/* free list */
+	struct igb_packet **free;
+	unsigned int nfree;
+	unsigned int num;
+	unsigned int watermark;	/* empty descriptors before a refill */
+	struct igb_packet *packets;
+	struct igb_dma_alloc *pages;
+	unsigned int npages;
+};
+
 /*
  * Receive ring: one per queue
  */
@@ -141,9 +275,15 @@ struct rx_ring {
 	struct resource rxdma;
 	union e1000_adv_rx_desc *rx_base;
 	bool hdr_split;
+	u32 hdr_size;	/* header buffer size with hdr_split */
+	u32 buf_size;	/* packet buffer size, SRRCTL.BSIZEPACKET */
+	bool timestamp;	/* timestamp-in-packet */
+	struct igb_rx_pool *pool;	/* library owned buffers, or NULL */
 	u32 next_to_refresh;
 	u32 next_to_check;
 	struct igb_rx_buffer *rx_buffers;
+	struct igb_packet *fmp;	/* first buffer of a partly received frame */
+	struct igb_packet *lmp;	/* last buffer of a partly received frame */
 	u32 bytes;
 	u32 packets;
 	int rdt;
@@ -154,6 +294,7 @@ struct rx_ring {
 	u64 rx_discarded;
 	u64 rx_packets;
 	u64 rx_bytes;
+	u64 rx_refill_fail;	/* refills short of buffers */
 
 	sem_t lock;
 };
@@ -161,7 +302,8 @@ struct rx_ring {
 struct adapter {
 	struct e1000_hw hw;
 
-	pthread_mutex_t *memlock;
+	struct igb_lock_domain *locks;
+	pthread_mutex_t *memlock; /* control lock, &locks->ctrl */
 
 	int ldev; /* file descriptor to igb */
 
@@ -181,6 +323,16 @@ struct adapter {
 	u16 num_tx_desc;
 	struct rx_ring *rx_rings;
 	u16 num_rx_desc;
+
+	/* TX head write-back area, one cache line per queue */
+	struct igb_dma_alloc txhwb;
+
+	/* NUMA nodes of the NIC and of buffers and packet metadata, or -1 */
+	int dev_node;
+	int numa_node;
+	int numa_ioctl; /* kernel module takes IGB_IOCTL_NUMA_NODE */
+	int region_ioctl; /* kernel module takes IGB_IOCTL_MAPREGION */
+	int pin_ioctl; /* kernel module takes IGB_IOCTL_PIN */
 #ifdef IGB_IEEE1588
 	/* IEEE 1588 precision time support */
 	struct cyclecounter cycles;
@@ -231,6 +383,13 @@ typedef struct _igb_vendor_info_t {
 #define IGB_IOCTL_UNMAPBUF	_IOW('E', 305, int)
 #define IGB_IOCTL_MAP_RX_RING	_IOW('E', 307, int)
 #define IGB_IOCTL_UNMAP_RX_RING _IOW('E', 308, int)
+#define IGB_IOCTL_ARM		_IOW('E', 309, int)
+#define IGB_IOCTL_MAPREGION	_IOW('E', 310, int)
+#define IGB_IOCTL_MAPBUF_BATCH	_IOW('E', 311, int)
+#define IGB_IOCTL_UNMAPBUF_BATCH _IOW('E', 312, int)
+#define IGB_IOCTL_NUMA_NODE	_IOW('E', 313, int)
+#define IGB_IOCTL_PIN		_IOW('E', 314, int)
+#define IGB_IOCTL_UNPIN		_IOW('E', 315, int)
 
 /*END*/
 
@@ -248,6 +407,47 @@ struct igb_buf_cmd {
 	u_int64_t pa;
 };
 
+#define IGB_REGION_HUGE	1
+
+struct igb_region_cmd {
+	u_int64_t physaddr; /* dma_addr_t is 64-bit */
+	u_int64_t pa;
+	u_int32_t size; /* requested in, mapped out */
+	u_int32_t flags;
+};
+
+#define IGB_BUF_BATCH_MAX	256
+
+struct igb_buf_batch_cmd {
+	u_int64_t bufs; /* struct igb_buf_cmd[count] */
+	u_int32_t count;
+	u_int32_t done; /* processed by the kernel */
+};
+
+#define IGB_NODE_DEVICE	(-1)
+
+struct igb_node_cmd {
+	int32_t node; /* wanted, IGB_NODE_DEVICE for the NIC's */
+	int32_t dev_node; /* the NIC's, -1 if unknown */
+};
+
+#define IGB_PIN_MAX_PAGES	4096
+#define IGB_PIN_CMD_WRITE	1
+
+struct igb_pin_cmd {
+	u_int64_t addr;
+	u_int64_t len;
+	u_int64_t bufs; /* u_int64_t[npages], bus address of each page */
+	u_int64_t handle;
+	u_int32_t npages; /* room in bufs in, pages pinned out */
+	u_int32_t flags;
+};
+
+struct igb_arm_cmd {
+	u_int32_t queue;
+	u_int32_t flags; /* IGB_ARM_RX | IGB_ARM_TX, 0 disarms */
+};
+
 struct igb_link_cmd {
 	u_int32_t up; /* dma_addr_t is 64-bit */
 	u_int32_t speed;